@@ -0,0 +1,142 @@
+/*
+ * micro-benchmark of the copy kernels of so_stdio.c against memcpy: the
+ * small records (1 to 32 bytes) the way so_fread and so_fwrite copy them
+ * out of and into the buffer, one after the other, and the large copies
+ * of the non-temporal kernels, from sizes that fit in the cache up to
+ * several times the last level cache
+ *
+ * the library is included so that the static kernels can be called
+ * directly; build with "make bench" in lin/ and run ./bench/copy_bench
+ */
+
+#include "../so_stdio.c"
+
+#include <stdio.h>
+#include <time.h>
+
+/* the buffer the records go through, as large as that of a stream */
+#define SMALL_SPAN (64 * 1024)
+#define SMALL_BYTES (512L * 1024 * 1024)
+#define LARGE_BYTES (4L * 1024 * 1024 * 1024)
+
+typedef void (*copy_fn)(char *dst, const char *src, size_t n);
+
+/* the size comes from a variable, so memcpy cannot be inlined either */
+static volatile size_t sink;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void copy_libc(char *dst, const char *src, size_t n)
+{
+	memcpy(dst, src, n);
+}
+
+static void copy_so(char *dst, const char *src, size_t n)
+{
+	so_copy(dst, src, n);
+}
+
+/*
+ * ns per record, copying records of size n through the whole span; the
+ * kernels are inlined in the loop as in so_fread and so_fwrite
+ */
+static inline __attribute__((always_inline))
+double bench_small(copy_fn copy, char *dst, const char *src, size_t n)
+{
+	long records = SMALL_BYTES / n;
+	size_t off = 0;
+	double start;
+	long i;
+
+	start = now();
+	for (i = 0; i < records; i++) {
+		copy(dst + off, src + off, n);
+		off += n;
+		if (off + n > SMALL_SPAN)
+			off = 0;
+	}
+	sink += dst[sink % SMALL_SPAN];
+
+	return (now() - start) * 1e9 / records;
+}
+
+/* GB/s copying n bytes at once, as so_copy does for a full buffer */
+static double bench_large(copy_fn copy, char *dst, const char *src, size_t n)
+{
+	long rounds = LARGE_BYTES / n;
+	double start;
+	long i;
+
+	if (rounds < 4)
+		rounds = 4;
+
+	copy(dst, src, n);
+	start = now();
+	for (i = 0; i < rounds; i++)
+		copy(dst, src, n);
+	sink += dst[sink % n];
+
+	return (double)n * rounds / (now() - start) / 1e9;
+}
+
+int main(void)
+{
+	static const size_t small[] = { 1, 2, 4, 8, 12, 16, 24, 32 };
+	static const size_t large[] = {
+		64 << 10, 256 << 10, 1 << 20, 4 << 20, 16 << 20, 64 << 20
+	};
+	size_t max = large[sizeof(large) / sizeof(large[0]) - 1];
+	copy_fn nt = NULL;
+	const char *nt_name = "none";
+	char *src, *dst;
+	size_t i;
+
+	pthread_once(&so_copy_once, so_copy_init);
+#if defined(__x86_64__)
+	if (so_copy_kind == SO_COPY_AVX512) {
+		nt = so_copy_avx512;
+		nt_name = "avx512";
+	} else if (so_copy_kind == SO_COPY_AVX2) {
+		nt = so_copy_avx2;
+		nt_name = "avx2";
+	}
+#endif
+
+	src = aligned_alloc(64, max);
+	dst = aligned_alloc(64, max);
+	if (src == NULL || dst == NULL)
+		return 1;
+	memset(src, 'x', max);
+	memset(dst, 0, max);
+
+	printf("records (ns per copy)\n%6s %8s %8s\n", "size", "memcpy",
+	       "so_copy");
+	for (i = 0; i < sizeof(small) / sizeof(small[0]); i++) {
+		sink = small[i];
+		printf("%6zu %8.2f %8.2f\n", small[i],
+		       bench_small(copy_libc, dst, src, sink),
+		       bench_small(copy_so, dst, src, sink));
+	}
+
+	printf("\nlarge copies (GB/s), non-temporal kernel %s, so_copy from "
+	       "%zu KiB\n%10s %8s %8s\n", nt_name, so_copy_nt_min >> 10,
+	       "size KiB", "memcpy", "nt");
+	for (i = 0; i < sizeof(large) / sizeof(large[0]); i++) {
+		printf("%10zu %8.2f", large[i] >> 10,
+		       bench_large(copy_libc, dst, src, large[i]));
+		if (nt != NULL)
+			printf(" %8.2f", bench_large(nt, dst, src, large[i]));
+		printf("\n");
+	}
+
+	free(src);
+	free(dst);
+
+	return 0;
+}
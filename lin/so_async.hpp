@@ -0,0 +1,478 @@
+/*
+ * C++20 coroutines over the STDIO library, header only
+ *
+ * so::task<T> is a lazily started coroutine and so::executor a pool of
+ * threads running them; async_read, async_write and async_flush are
+ * awaited from a task: what the buffer of the stream can serve (or take)
+ * is done right away, without suspending, and the operations that need
+ * syscalls run on a thread of the executor, which then resumes the task,
+ * so a few threads keep many streams going while each task reads as
+ * sequential code. a stream is used by one task at a time
+ */
+
+#ifndef SO_ASYNC_HPP
+#define SO_ASYNC_HPP
+
+#include <condition_variable>
+#include <coroutine>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "so_stdio.hpp"
+
+namespace so {
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+/* the task that awaited the one ending goes on, on the same thread */
+struct final_awaiter {
+	bool await_ready() const noexcept
+	{
+		return false;
+	}
+
+	template <typename Promise>
+	std::coroutine_handle<>
+	await_suspend(std::coroutine_handle<Promise> h) noexcept
+	{
+		return h.promise().continuation;
+	}
+
+	void await_resume() const noexcept
+	{
+	}
+};
+
+/* the part of the promises that does not depend on the result */
+struct promise_base {
+	std::coroutine_handle<> continuation = std::noop_coroutine();
+
+	std::suspend_always initial_suspend() const noexcept
+	{
+		return {};
+	}
+
+	final_awaiter final_suspend() const noexcept
+	{
+		return {};
+	}
+};
+
+template <typename T>
+struct promise : promise_base {
+	std::variant<std::monostate, T, std::exception_ptr> result;
+
+	task<T> get_return_object() noexcept;
+
+	template <typename U>
+	void return_value(U &&value)
+	{
+		result.template emplace<1>(std::forward<U>(value));
+	}
+
+	void unhandled_exception() noexcept
+	{
+		result.template emplace<2>(std::current_exception());
+	}
+
+	T take()
+	{
+		if (result.index() == 2)
+			std::rethrow_exception(std::get<2>(result));
+		return std::move(std::get<1>(result));
+	}
+};
+
+template <>
+struct promise<void> : promise_base {
+	std::exception_ptr error;
+
+	task<void> get_return_object() noexcept;
+
+	void return_void() const noexcept
+	{
+	}
+
+	void unhandled_exception() noexcept
+	{
+		error = std::current_exception();
+	}
+
+	void take() const
+	{
+		if (error)
+			std::rethrow_exception(error);
+	}
+};
+
+} /* namespace detail */
+
+template <typename T>
+class task {
+public:
+	using promise_type = detail::promise<T>;
+
+	explicit task(std::coroutine_handle<promise_type> handle) noexcept
+		: handle_(handle)
+	{
+	}
+
+	task(task &&other) noexcept
+		: handle_(std::exchange(other.handle_, nullptr))
+	{
+	}
+
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+	task &operator=(task &&) = delete;
+
+	~task()
+	{
+		if (handle_)
+			handle_.destroy();
+	}
+
+	/* awaiting a task starts it and gets its result */
+	auto operator co_await() && noexcept
+	{
+		struct awaiter {
+			std::coroutine_handle<promise_type> handle;
+
+			bool await_ready() const noexcept
+			{
+				return false;
+			}
+
+			std::coroutine_handle<>
+			await_suspend(std::coroutine_handle<> caller) noexcept
+			{
+				handle.promise().continuation = caller;
+				return handle;
+			}
+
+			T await_resume()
+			{
+				return handle.promise().take();
+			}
+		};
+
+		return awaiter{handle_};
+	}
+
+private:
+	std::coroutine_handle<promise_type> handle_;
+};
+
+namespace detail {
+
+template <typename T>
+task<T> promise<T>::get_return_object() noexcept
+{
+	return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object() noexcept
+{
+	return task<void>(
+		std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+} /* namespace detail */
+
+/*
+ * a pool of threads running jobs in the order they were posted; spawn
+ * starts a task that nobody awaits and wait blocks until all of those
+ * are done (the destructor waits for them too)
+ */
+class executor {
+public:
+	explicit executor(unsigned threads =
+			  std::thread::hardware_concurrency())
+	{
+		if (threads == 0)
+			threads = 1;
+		for (unsigned i = 0; i < threads; i++)
+			workers_.emplace_back([this] { run(); });
+	}
+
+	executor(const executor &) = delete;
+	executor &operator=(const executor &) = delete;
+
+	~executor()
+	{
+		wait();
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			stopping_ = true;
+		}
+		ready_.notify_all();
+		for (std::thread &worker : workers_)
+			worker.join();
+	}
+
+	void post(std::function<void()> job)
+	{
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			jobs_.push_back(std::move(job));
+		}
+		ready_.notify_one();
+	}
+
+	void spawn(task<void> work)
+	{
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			spawned_++;
+		}
+		detach(std::move(work));
+	}
+
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(lock_);
+
+		idle_.wait(lock, [this] { return spawned_ == 0; });
+	}
+
+private:
+	/* the coroutine frame of a spawned task frees itself at the end */
+	struct detached {
+		struct promise_type {
+			detached get_return_object() const noexcept
+			{
+				return {};
+			}
+
+			/* it runs up to schedule, which posts it */
+			std::suspend_never initial_suspend() const noexcept
+			{
+				return {};
+			}
+
+			std::suspend_never final_suspend() const noexcept
+			{
+				return {};
+			}
+
+			void return_void() const noexcept
+			{
+			}
+
+			void unhandled_exception() const noexcept
+			{
+				std::terminate();
+			}
+		};
+	};
+
+	/* the handle of the frame, posted before the body starts */
+	struct schedule {
+		executor *ex;
+
+		bool await_ready() const noexcept
+		{
+			return false;
+		}
+
+		void await_suspend(std::coroutine_handle<> h) const
+		{
+			ex->post([h] { h.resume(); });
+		}
+
+		void await_resume() const noexcept
+		{
+		}
+	};
+
+	detached detach(task<void> work)
+	{
+		co_await schedule{this};
+		co_await std::move(work);
+		finished();
+	}
+
+	void finished()
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+
+		if (--spawned_ == 0)
+			idle_.notify_all();
+	}
+
+	void run()
+	{
+		std::function<void()> job;
+
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(lock_);
+
+				ready_.wait(lock, [this] {
+					return stopping_ || !jobs_.empty();
+				});
+				if (jobs_.empty())
+					return;
+				job = std::move(jobs_.front());
+				jobs_.pop_front();
+			}
+			job();
+		}
+	}
+
+	std::mutex lock_;
+	std::condition_variable ready_;
+	std::condition_variable idle_;
+	std::deque<std::function<void()>> jobs_;
+	std::vector<std::thread> workers_;
+	unsigned long spawned_ = 0;
+	bool stopping_ = false;
+};
+
+namespace detail {
+
+/*
+ * done inline when fast says so (the buffer serves the operation and
+ * stores its result), otherwise op runs on the executor, which resumes
+ * the awaiting coroutine right after it
+ */
+template <typename Result, typename Fast, typename Op>
+struct io_awaiter {
+	executor &ex;
+	Fast fast;
+	Op op;
+	Result result{};
+
+	bool await_ready()
+	{
+		return fast(result);
+	}
+
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		ex.post([this, h] {
+			result = op();
+			h.resume();
+		});
+	}
+
+	Result await_resume() const noexcept
+	{
+		return result;
+	}
+};
+
+template <typename Result, typename Fast, typename Op>
+io_awaiter<Result, Fast, Op> make_io(executor &ex, Fast fast, Op op)
+{
+	return {ex, std::move(fast), std::move(op)};
+}
+
+} /* namespace detail */
+
+/* the number of whole elements read, as so_fread */
+template <trivial T, std::size_t N>
+	requires (!std::is_const_v<T>)
+auto async_read(executor &ex, SO_FILE *file, std::span<T, N> buf)
+{
+	std::size_t bytes = buf.size_bytes();
+
+	/*
+	 * done in place when the buffer holds the data already, so that
+	 * so_freadrecs neither fills the buffer nor turns the stream around
+	 */
+	auto fast = [file, buf, bytes](std::size_t &result) {
+		std::size_t count;
+
+		if (bytes == 0 || so_fbuffered(file, 0) < bytes)
+			return false;
+
+		std::memcpy(buf.data(), so_freadrecs(file, bytes, 1, &count),
+			    bytes);
+		result = buf.size();
+		return true;
+	};
+	auto op = [file, buf] {
+		return so_fread(buf.data(), sizeof(T), buf.size(), file);
+	};
+
+	return detail::make_io<std::size_t>(ex, fast, op);
+}
+
+/* the number of whole elements accepted, as so_fwrite */
+template <trivial T, std::size_t N>
+auto async_write(executor &ex, SO_FILE *file, std::span<T, N> buf)
+{
+	std::size_t bytes = buf.size_bytes();
+
+	/*
+	 * the data is copied in place when the stream is writing already and
+	 * the buffer is left not full, so that nothing is flushed
+	 */
+	auto fast = [file, buf, bytes](std::size_t &result) {
+		std::size_t room;
+		void *data;
+
+		if (bytes == 0 || so_fbuffered(file, 1) <= bytes)
+			return false;
+
+		data = so_freserverecs(file, 1, bytes + 1, &room);
+		if (data == nullptr || room <= bytes)
+			return false;
+
+		std::memcpy(data, buf.data(), bytes);
+		if (so_fcommitrecs(file, 1, bytes) == SO_EOF)
+			return false;
+		result = buf.size();
+		return true;
+	};
+	auto op = [file, buf] {
+		return so_fwrite(buf.data(), sizeof(T), buf.size(), file);
+	};
+
+	return detail::make_io<std::size_t>(ex, fast, op);
+}
+
+/* so_fflush, always on the executor */
+inline auto async_flush(executor &ex, SO_FILE *file)
+{
+	auto fast = [](int &) { return false; };
+	auto op = [file] { return so_fflush(file); };
+
+	return detail::make_io<int>(ex, fast, op);
+}
+
+template <typename Policy, trivial T, std::size_t N>
+	requires Policy::readable && (!std::is_const_v<T>)
+auto async_read(executor &ex, stream<Policy> &file, std::span<T, N> buf)
+{
+	return async_read(ex, file.native(), buf);
+}
+
+template <typename Policy, trivial T, std::size_t N>
+	requires Policy::writable
+auto async_write(executor &ex, stream<Policy> &file, std::span<T, N> buf)
+{
+	return async_write(ex, file.native(), buf);
+}
+
+template <typename Policy>
+	requires Policy::writable
+auto async_flush(executor &ex, stream<Policy> &file)
+{
+	return async_flush(ex, file.native());
+}
+
+} /* namespace so */
+
+#endif /* SO_ASYNC_HPP */
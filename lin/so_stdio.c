@@ -1,27 +1,200 @@
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "so_stdio.h"
 
 #define BUF_SIZE 4096
 
+/* buffer size and fallback block alignment used by O_DIRECT streams */
+#define DIRECT_BUF_SIZE (1024 * 1024)
+#define DIRECT_ALIGN 4096
+
+/* stream options selected by the modifiers that follow the base mode */
+#define SO_OPT_DIRECT 0x01
+#define SO_OPT_SHARED 0x02
+#define SO_OPT_NONBLOCK 0x04
+#define SO_OPT_COMPRESS 0x08
+#define SO_OPT_THREAD 0x10
+#define SO_OPT_SPARSE 0x20
+#define SO_OPT_FOLLOW 0x40
+
+/* what wakes up a follow stream at the end of the file */
+#define FOLLOW_FILE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | \
+			    IN_DELETE_SELF)
+#define FOLLOW_DIR_EVENTS (IN_CREATE | IN_MOVED_TO)
+
+/* size of the private buffer of each thread writing to a shared stream */
+#define SHARED_BUF_SIZE (64 * 1024)
+
+/* bounds of the extents preallocated ahead of the writes */
+#define PREALLOC_MIN (1024 * 1024)
+#define PREALLOC_MAX (64 * 1024 * 1024)
+
+/* bytes per copy_file_range call and buffer of the so_fcopy_file fallback */
+#define COPY_CHUNK (1024 * 1024 * 1024)
+#define COPY_BUF_SIZE (1024 * 1024)
+
+/*
+ * buffers of this size and more may be backed by transparent huge pages:
+ * they are mapped at a huge page boundary, in whole huge pages
+ */
+#define BUF_HUGE_MIN (2 * 1024 * 1024)
+
+/* who allocated the buffer of a stream, and how it is released */
+#define BUFFER_HEAP 0
+#define BUFFER_MAPPED 1
+#define BUFFER_SLAB 2
+
+/* directories kept open by a so_fopen_many call */
+#define DIRCACHE_SIZE 16
+
+/* so_fslurp maps the files from this size up instead of reading them */
+#define SLURP_MMAP_MIN (1024 * 1024)
+
+/* geometry of the block cache used by so_pread */
+#define PCACHE_BLOCKS 8
+#define PCACHE_BLOCK_SIZE (64 * 1024)
+
+/* a block of the file cached for positional reads */
+struct so_pcache_block {
+	/* offset of the block in the file, -1 if the slot is free */
+	long offset;
+	/* number of valid bytes, less than the block size at the end of file */
+	int size;
+	/* last use of the block, used to pick the one to evict */
+	unsigned long stamp;
+	char *data;
+};
+
+/* private buffer of a thread writing to a shared stream */
+struct so_wbuf {
+	char *data;
+	/* number of bytes waiting in data */
+	int size;
+	/* all the buffers of a stream are kept in a list */
+	struct so_wbuf *next;
+};
+
+/* state of a stream opened in shared writer mode */
+struct so_shared {
+	/* the buffer of the calling thread */
+	pthread_key_t key;
+	/* protects bufs and is used together with idle */
+	pthread_mutex_t lock;
+	/* signaled when the last write in flight completes */
+	pthread_cond_t idle;
+	struct so_wbuf *bufs;
+	/* the end of the data reserved so far, advanced by fetch-and-add */
+	long offset;
+	/* number of pwrite calls in flight */
+	int inflight;
+};
+
+/*
+ * compressed streams are a sequence of blocks of at most ZBLOCK_SIZE
+ * bytes, each one preceded by a header of ZHDR_SIZE bytes: the magic
+ * "SZB", the codec (ZCODEC_*), the uncompressed size and the size of the
+ * payload, both 32 bit little endian
+ */
+#define ZBLOCK_SIZE (64 * 1024)
+#define ZHDR_SIZE 12
+#define ZCODEC_STORED 0
+#define ZCODEC_LZ 1
+#define ZHASH_BITS 13
+
+/* a block of a compressed stream, at offset off in the file */
+struct so_zblock {
+	long off;
+	/* the uncompressed offset of its first byte */
+	long raw;
+};
+
+/* state of a compressed stream, the cookie of its I/O callbacks */
+struct so_zstream {
+	int fd;
+	/* 1 for "w" and "a", 0 for "r" */
+	int writing;
+	/* the uncompressed data of the current block */
+	char *raw;
+	int raw_len;
+	int raw_pos;
+	/* header followed by the payload of a block */
+	char *packed;
+	/* the uncompressed offset of the beginning of raw */
+	long raw_start;
+	/* the index of the block in raw, -1 before the first one */
+	int cur;
+	/*
+	 * the blocks found so far, used to seek to a block without reading
+	 * the ones before it; the file is known up to scan_off, which is at
+	 * the uncompressed offset scan_raw
+	 */
+	struct so_zblock *index;
+	int nindex;
+	int index_cap;
+	long scan_off;
+	long scan_raw;
+	int scan_done;
+	int hash[1 << ZHASH_BITS];
+	/* a worker thread compresses the full blocks handed to it in pending */
+	int threaded;
+	pthread_t worker;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *pending;
+	int pending_len;
+	int stop;
+	int worker_error;
+};
+
+/* cache shared by all the threads doing positional reads on a stream */
+struct so_pcache {
+	unsigned long clock;
+	struct so_pcache_block blocks[PCACHE_BLOCKS];
+};
+
+/*
+ * the memory of the streams opened together by so_fopen_many, with their
+ * buffers and paths; it is freed when the last of them is closed
+ */
+struct so_slab {
+	int refs;
+};
+
 struct _so_file {
 	/* buffer used for read write operations */
-	char buffer[BUF_SIZE];
+	char *buffer;
+	/* the size of the allocated buffer */
+	int buffer_size;
 	/* the file descriptor */
 	int fd;
 	/* the mode used for the file */
 	int mode;
 	/* the position of the cursor in the buffer */
 	int buffer_position;
-	/* the position of the cursor in the file */
-	int cursor;
-	/* 
+	/* the logical position in the file, the one returned by so_ftell */
+	long cursor;
+	/* the position of the cursor of the file descriptor */
+	long file_offset;
+	/*
 	 * current size of the buffer stored
 	 * in the buffer field
 	 */
@@ -30,501 +203,4396 @@ struct _so_file {
 	int read_write;
 	/* used by ferror, 0 if not error, 1 if error */
 	int error;
+	/* set when a read got to the end of the file */
+	int eof;
 	/* pid of child process */
 	int pid;
+	/* 1 if the file was opened with O_DIRECT */
+	int direct;
+	/* the block size O_DIRECT transfers are aligned to */
+	int align;
 	/*
-	 * flag that says if the child
-	 * process got tp the end of the file
+	 * bytes at the beginning of the buffer of a direct stream
+	 * that were already written by the last flush
 	 */
-	int child_at_end;
+	int buffer_synced;
 	/* path of the file */
 	char *pathname;
+	/*
+	 * 1 for read/write streams that keep the buffer as a window of the
+	 * file over direction changes; the bytes in [dirty_start, dirty_end)
+	 * were modified and not written yet
+	 */
+	int unified;
+	int dirty_start;
+	int dirty_end;
+	/*
+	 * 1 for memory streams, which have no descriptor: the buffer is the
+	 * memory itself and the window never moves
+	 */
+	int mem;
+	/* 1 if the library allocated the memory of so_fmemopen */
+	int mem_owned;
+	/* where so_open_memstream publishes its growing buffer */
+	char **memstream_ptr;
+	size_t *memstream_size;
+	/*
+	 * streams of so_fopencookie do their I/O through the user callbacks
+	 * instead of the syscalls on fd
+	 */
+	int cookie_io;
+	void *cookie;
+	so_cookie_io_functions_t io;
+	/* 1 if the descriptor is non-blocking and EAGAIN is not an error */
+	int nonblock;
+	/* 1 if the data is transferred with pread/pwrite at file_offset */
+	int positional;
+	/* reads stop at this offset, -1 if they go up to the end of file */
+	long limit;
+	/* shared writer state, NULL for the other streams */
+	struct so_shared *shared;
+	/* compressed stream state (also the cookie), NULL for the others */
+	struct so_zstream *z;
+	/* 1 when crc is the CRC32C of the bytes read and written so far */
+	int crc_on;
+	unsigned int crc;
+	/*
+	 * space reserved with fallocate: 1 when the growth policy is on, -1
+	 * when the file system does not support it; the file is allocated
+	 * up to prealloc_end, at least up to prealloc_hint, and the data of
+	 * the stream ends at prealloc_base + file_offset
+	 */
+	int prealloc;
+	long prealloc_end;
+	long prealloc_hint;
+	long prealloc_base;
+	/*
+	 * group commit: the callers of so_fsync take increasing tickets and
+	 * one of them syncs for all the tickets up to sync_done; sync_full
+	 * asks the next round for fsync instead of fdatasync
+	 */
+	int group_commit;
+	long sync_delay;
+	pthread_mutex_t sync_lock;
+	pthread_cond_t sync_cond;
+	unsigned long sync_requested;
+	unsigned long sync_done;
+	int syncing;
+	int sync_full;
+	int sync_failed;
+	/*
+	 * the last data and hole ranges of the file found with SEEK_DATA and
+	 * SEEK_HOLE; sparse streams (positional, so the probes do not move
+	 * anything) fill the buffer with zeros over the holes
+	 */
+	int sparse;
+	long data_start;
+	long data_end;
+	long hole_start;
+	long hole_end;
+	/*
+	 * 1 for follow streams, whose reads at the end of the file wait on
+	 * the inotify instance follow_fd, watching the file (follow_wd) and
+	 * its directory
+	 */
+	int follow;
+	int follow_fd;
+	int follow_wd;
+	/* the slab holding the stream, NULL if it was allocated on its own */
+	struct so_slab *slab;
+	/*
+	 * BUFFER_* for the buffer, the alignment of its address, the size of
+	 * its mapping and 1 if it was advised for huge pages
+	 */
+	int buffer_kind;
+	size_t buffer_align;
+	size_t buffer_mapped;
+	int buffer_huge;
+	/* protects pcache, allocated by the first so_pread */
+	pthread_mutex_t pcache_lock;
+	struct so_pcache *pcache;
 };
 
-SO_FILE *so_fopen(const char *pathname, const char *mode)
+/*
+ * parse a mode of the form "r", "r+", "w", "w+", "a" or "a+" followed
+ * by optional modifiers ('d' - O_DIRECT, 's' - shared writer,
+ * 'n' - non-blocking, 'z' - compressed, 't' - compress on a worker thread,
+ * 'h' - hole-aware reads, 'f' - follow)
+ */
+static int so_parse_mode(const char *mode, int *mode_flags, int *options)
 {
-	SO_FILE *file = malloc(sizeof(SO_FILE));
-	int mode_flags;
-
-	/* figure out which flags to be used for the open function */
-	if (strcmp(mode, "r") == 0) {
-		mode_flags = O_RDONLY;
-	} else if (strcmp(mode, "r+") == 0) {
-		mode_flags = O_RDWR;
-	} else if (strcmp(mode, "w") == 0) {
-		mode_flags = O_WRONLY | O_CREAT | O_TRUNC;
-	} else if (strcmp(mode, "w+") == 0) {
-		mode_flags = O_RDWR | O_CREAT | O_TRUNC;
-	} else if (strcmp(mode, "a") == 0) {
-		mode_flags = O_APPEND | O_WRONLY | O_CREAT;
-	} else if (strcmp(mode, "a+") == 0) {
-		mode_flags = O_APPEND | O_RDWR | O_CREAT;
-	} else {
-		free(file);
-		return NULL;
-	}
+	const char *p = mode + 1;
 
-	/* open the file */
-	int file_descriptor = open(pathname, mode_flags, 0644);
+	if (mode[0] == 'r')
+		*mode_flags = O_RDONLY;
+	else if (mode[0] == 'w')
+		*mode_flags = O_WRONLY | O_CREAT | O_TRUNC;
+	else if (mode[0] == 'a')
+		*mode_flags = O_APPEND | O_WRONLY | O_CREAT;
+	else
+		return -1;
 
-	/* treat the error */
-	if (file_descriptor == -1) {
-		free(file);
-		return NULL;
+	if (*p == '+') {
+		*mode_flags = (*mode_flags & ~(O_RDONLY | O_WRONLY)) | O_RDWR;
+		p++;
 	}
 
-	/* initialize all the other members of the structure */
-	file->fd = file_descriptor;
-	file->mode = mode_flags;
-	file->pathname = malloc((strlen(pathname) + 1) * sizeof(char));
-	strcpy(file->pathname, pathname);
-	file->pathname[strlen(pathname)] = '\0';
-	file->buffer_position = 0;
-	file->cursor = 0;
-	file->curr_buff_size = 0;
-	file->read_write = -1;
-	file->error = 0;
-	file->pid = -1;
-	file->child_at_end = 0;
-
-	return file;
-}
-
-int so_fclose(SO_FILE *stream)
-{
-	int res;
-	int res_ferror = 0;
-	int status;
+	*options = 0;
+	for (; *p != '\0'; p++) {
+		if (*p == 'd')
+			*options |= SO_OPT_DIRECT;
+		else if (*p == 's')
+			*options |= SO_OPT_SHARED;
+		else if (*p == 'n')
+			*options |= SO_OPT_NONBLOCK;
+		else if (*p == 'z')
+			*options |= SO_OPT_COMPRESS;
+		else if (*p == 't')
+			*options |= SO_OPT_THREAD;
+		else if (*p == 'h')
+			*options |= SO_OPT_SPARSE;
+		else if (*p == 'f')
+			*options |= SO_OPT_FOLLOW;
+		else
+			return -1;
+	}
 
 	/*
-	 * if the buffer cursor is not at its beginning and if
-	 * we are after a write process, then we should flush the
-	 * output once again
+	 * compressed streams go one way only, through blocks that do not
+	 * fit O_DIRECT, shared writers or partial transfers
 	 */
-	if (stream->buffer_position > 0 && stream->read_write == 1) {
-		so_fflush(stream);
-		res_ferror = stream->error;
-	}
+	if ((*options & SO_OPT_COMPRESS) &&
+	    ((*mode_flags & O_ACCMODE) == O_RDWR ||
+	     (*options & ~(SO_OPT_COMPRESS | SO_OPT_THREAD))))
+		return -1;
+	if ((*options & SO_OPT_THREAD) &&
+	    (!(*options & SO_OPT_COMPRESS) || mode[0] == 'r'))
+		return -1;
 
-	/* close the file */
-	res = close(stream->fd);
+	/* follow streams read, maybe without blocking */
+	if ((*options & SO_OPT_FOLLOW) &&
+	    ((*mode_flags & O_ACCMODE) != O_RDONLY ||
+	     (*options & ~(SO_OPT_FOLLOW | SO_OPT_NONBLOCK))))
+		return -1;
 
-	/* free allocated memory */
-	free(stream->pathname);
-	free(stream);
+	/* hole-aware streams only read, at offsets they compute */
+	if ((*options & SO_OPT_SPARSE) &&
+	    ((*mode_flags & O_ACCMODE) != O_RDONLY ||
+	     *options != SO_OPT_SPARSE))
+		return -1;
 
-	if (res_ferror == 1)
-		return SO_EOF;
+	/*
+	 * shared writers write at any offset, so they are not compatible
+	 * with O_DIRECT and make no sense for reading
+	 */
+	if ((*options & SO_OPT_SHARED) &&
+	    ((*options & SO_OPT_DIRECT) || mode[0] == 'r'))
+		return -1;
 
-	if (res == -1)
-		return SO_EOF;
 	return 0;
 }
 
-int so_fileno(SO_FILE *stream)
+/* the block size O_DIRECT transfers on fd have to be aligned to */
+static int so_direct_align(int fd)
 {
-	/* return the file descriptor */
-	return stream->fd;
+	struct stat st;
+
+	if (fstat(fd, &st) == -1 || st.st_blksize < 512 ||
+	    (st.st_blksize & (st.st_blksize - 1)) != 0)
+		return DIRECT_ALIGN;
+
+	return st.st_blksize;
 }
 
-int so_fflush(SO_FILE *stream)
+/*
+ * copies between the buffer of a stream and the memory of the caller:
+ * up to 32 bytes (single members, small records) with a few overlapping
+ * loads and stores instead of a call, the copies of a cache size and
+ * more (only seen with large buffers) with non-temporal stores that do
+ * not evict the cache, and memcpy for everything in between
+ */
+#define SO_COPY_GENERIC 0
+#define SO_COPY_AVX2 1
+#define SO_COPY_AVX512 2
+/*
+ * the copies as large as the last level cache, or at least this large
+ * (the caches reported in virtual machines may be those of the host).
+ * bench/copy_bench puts the crossover between 1MiB and 4MiB on a Xeon
+ * with AVX-512 and 2MiB of L2: memcpy copies 1MiB at 22GB/s against
+ * 18GB/s, while 4MiB go at 15GB/s against 12GB/s and 64MiB at 10-13GB/s
+ * against 6-8GB/s. only the buffers set to 4MiB or more with so_setvbuf
+ * get there, the default one stays on memcpy and the small records;
+ * those take 2-3ns a copy against 8-11ns for a memcpy call
+ */
+#define SO_COPY_NT_MIN (4 * 1024 * 1024)
+
+static pthread_once_t so_copy_once = PTHREAD_ONCE_INIT;
+static int so_copy_kind = SO_COPY_GENERIC;
+static size_t so_copy_nt_min = (size_t)-1;
+
+static void so_copy_init(void)
 {
-	int res;
-	int stream_size = stream->buffer_position;
-	int current_cursor = 0;
+	long llc = SO_COPY_NT_MIN;
 
-	/*
-	 *write the data that is currently in the buffer
-	 * use a while loop as the write call will not always
-	 * return a value equal to stream_size
-	 */
-	while (stream_size > 0) {
-		if (stream->read_write == 0)
-			break;
+#if defined(_SC_LEVEL3_CACHE_SIZE)
+	if (sysconf(_SC_LEVEL3_CACHE_SIZE) > 0 &&
+	    sysconf(_SC_LEVEL3_CACHE_SIZE) < llc)
+		llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+	so_copy_nt_min = llc;
 
-		/* write to file */
-		res = write(stream->fd, stream->buffer + current_cursor, stream_size);
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx512f"))
+		so_copy_kind = SO_COPY_AVX512;
+	else if (__builtin_cpu_supports("avx2"))
+		so_copy_kind = SO_COPY_AVX2;
+#endif
+}
 
-		/* treat error */
-		if (res == -1) {
-			stream->error = 1;
-			return SO_EOF;
-		}
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void so_copy_avx2(char *dst, const char *src, size_t n)
+{
+	size_t head = -(unsigned long)dst & 31;
+	__m256i a, b, c, d;
 
-		/* set the new cursors and the new buffer size */
-		current_cursor += res;
-		stream_size -= res;
-		stream->cursor += res;
-	}
+	/* the streaming stores need an aligned destination */
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	n -= head;
 
-	/* reinitialize the buffer */
-	stream->buffer_position = 0;
-	stream->curr_buff_size = 0;
+	for (; n >= 128; n -= 128, dst += 128, src += 128) {
+		a = _mm256_loadu_si256((const __m256i *)src);
+		b = _mm256_loadu_si256((const __m256i *)(src + 32));
+		c = _mm256_loadu_si256((const __m256i *)(src + 64));
+		d = _mm256_loadu_si256((const __m256i *)(src + 96));
+		_mm256_stream_si256((__m256i *)dst, a);
+		_mm256_stream_si256((__m256i *)(dst + 32), b);
+		_mm256_stream_si256((__m256i *)(dst + 64), c);
+		_mm256_stream_si256((__m256i *)(dst + 96), d);
+	}
+	_mm_sfence();
 
-	return 0;
+	memcpy(dst, src, n);
 }
 
-int so_fseek(SO_FILE *stream, long offset, int whence)
+__attribute__((target("avx512f")))
+static void so_copy_avx512(char *dst, const char *src, size_t n)
 {
-	int res;
+	size_t head = -(unsigned long)dst & 63;
+	__m512i a, b, c, d;
 
-	/*
-	 * if the previous read-write operation was a write
-	 * then we need to fluch the buffer once again
-	 */
-	if (stream->read_write == 1) {
-		if (stream->buffer_position > 0)
-			so_fflush(stream);
-		stream->read_write = -1;
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	n -= head;
+
+	for (; n >= 256; n -= 256, dst += 256, src += 256) {
+		a = _mm512_loadu_si512(src);
+		b = _mm512_loadu_si512(src + 64);
+		c = _mm512_loadu_si512(src + 128);
+		d = _mm512_loadu_si512(src + 192);
+		_mm512_stream_si512((__m512i *)dst, a);
+		_mm512_stream_si512((__m512i *)(dst + 64), b);
+		_mm512_stream_si512((__m512i *)(dst + 128), c);
+		_mm512_stream_si512((__m512i *)(dst + 192), d);
 	}
+	_mm_sfence();
 
-	/* call lseek to move the actual cursor in the file */
-	if (whence == SEEK_SET || whence == SEEK_CUR || whence == SEEK_END)
-		res = lseek(stream->fd, offset, whence);
-	else
-		return -1;
+	memcpy(dst, src, n);
+}
+#endif
 
-	if (res == -1)
-		return -1;
-	/* update the cursor field and reset the buffer fields */
-	stream->cursor = res;
-	stream->buffer_position = 0;
-	stream->curr_buff_size = 0;
+static inline void so_copy(void *dst, const void *src, size_t n)
+{
+	unsigned long long a, b, c, d;
+	unsigned int x, y;
+	char *to = dst;
+	const char *from = src;
 
-	return 0;
+	/* the two halves overlap, so every size of a class is handled alike */
+	if (n > 32) {
+#if defined(__x86_64__)
+		if (n >= so_copy_nt_min && so_copy_kind == SO_COPY_AVX512) {
+			so_copy_avx512(to, from, n);
+			return;
+		}
+		if (n >= so_copy_nt_min && so_copy_kind == SO_COPY_AVX2) {
+			so_copy_avx2(to, from, n);
+			return;
+		}
+#endif
+		memcpy(to, from, n);
+	} else if (n >= 16) {
+		memcpy(&a, from, 8);
+		memcpy(&b, from + 8, 8);
+		memcpy(&c, from + n - 16, 8);
+		memcpy(&d, from + n - 8, 8);
+		memcpy(to, &a, 8);
+		memcpy(to + 8, &b, 8);
+		memcpy(to + n - 16, &c, 8);
+		memcpy(to + n - 8, &d, 8);
+	} else if (n >= 8) {
+		memcpy(&a, from, 8);
+		memcpy(&b, from + n - 8, 8);
+		memcpy(to, &a, 8);
+		memcpy(to + n - 8, &b, 8);
+	} else if (n >= 4) {
+		memcpy(&x, from, 4);
+		memcpy(&y, from + n - 4, 4);
+		memcpy(to, &x, 4);
+		memcpy(to + n - 4, &y, 4);
+	} else if (n > 0) {
+		x = from[0];
+		y = from[n - 1];
+		to[n / 2] = from[n / 2];
+		to[0] = x;
+		to[n - 1] = y;
+	}
 }
 
-long so_ftell(SO_FILE *stream)
+/* initialize a zeroed stream over an already opened file descriptor */
+static void so_init_file(SO_FILE *file, int fd, int mode_flags, int options)
 {
-	/* return the current cursor */
-	return stream->cursor;
+	file->buffer_size = BUF_SIZE;
+	file->align = 1;
+	file->fd = fd;
+	file->mode = mode_flags;
+	file->nonblock = (options & SO_OPT_NONBLOCK) != 0;
+	file->read_write = -1;
+	file->pid = -1;
+	file->limit = -1;
+	pthread_once(&so_copy_once, so_copy_init);
+	pthread_mutex_init(&file->pcache_lock, NULL);
+	pthread_mutex_init(&file->sync_lock, NULL);
+	pthread_cond_init(&file->sync_cond, NULL);
 }
 
-size_t so_fread(void *ptr, size_t size, size_t nmemb, SO_FILE *stream)
+/*
+ * allocate the buffer of a stream, aligned to align and at least to a
+ * page; with huge, the buffers of BUF_HUGE_MIN bytes and more are mapped
+ * on their own, in whole huge pages advised with MADV_HUGEPAGE
+ */
+static char *so_buffer_alloc(SO_FILE *stream, size_t size, size_t align,
+			     int huge)
 {
-	int bytes_to_read;
-	int cursor_ptr = 0;
-	int bytes_read_res = 0;
-	int count;
-	int bytes_unread_buffer;
+	size_t page = sysconf(_SC_PAGESIZE), len;
+	char *map, *start;
+	void *buffer;
 
-	/*
-	 * if read is called after a write, then we have
-	 * to reset the buffer
-	 */
-	if (stream->read_write == 1) {
-		stream->buffer_position = 0;
-		stream->curr_buff_size = 0;
-	}
-	stream->read_write = 0;
-
-	/* total bytes that need to be returned */
-	bytes_to_read = size * nmemb;
+	if (align < page)
+		align = page;
 
-	/* read inside a while loop until we read all the bytes that we needed */
-	while (bytes_to_read > 0) {
-		bytes_unread_buffer = stream->curr_buff_size - stream->buffer_position;
+	if (huge && size >= BUF_HUGE_MIN) {
+		/* map a huge page more and keep the aligned part */
+		len = (size + BUF_HUGE_MIN - 1) / BUF_HUGE_MIN * BUF_HUGE_MIN;
+		map = mmap(NULL, len + BUF_HUGE_MIN, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED)
+			return NULL;
 
-		/*
-		 * if the number of bytes free left in the buffer is greater than the
-		 * number of bytes left to read, then we copy the number of bytes
-		 * that we have to read in the buffer
-		 */
-		if (bytes_unread_buffer > bytes_to_read) {
-			memcpy(ptr + cursor_ptr, stream->buffer + stream->buffer_position, bytes_to_read);
-			stream->buffer_position += bytes_to_read;
-			bytes_to_read = 0;
-			cursor_ptr += bytes_to_read;
-		/*
-		 * if the above condition is not satisfied, then we copy the number of
-		 * bytes free left in the buffer
-		 */
-		} else {
-			memcpy(ptr + cursor_ptr, stream->buffer + stream->buffer_position, bytes_unread_buffer);
-			stream->buffer_position += bytes_unread_buffer;
-			bytes_to_read -= bytes_unread_buffer;
-			cursor_ptr += bytes_unread_buffer;
-		}
+		start = (char *)(((unsigned long)map + BUF_HUGE_MIN - 1) &
+				 ~(unsigned long)(BUF_HUGE_MIN - 1));
+		if (start > map)
+			munmap(map, start - map);
+		munmap(start + len, BUF_HUGE_MIN - (start - map));
 
-		/* read more bytes until we filled the buffer */
-		if ((bytes_to_read > 0) && (stream->curr_buff_size == stream->buffer_position)) {
-			count = read(stream->fd, stream->buffer, BUF_SIZE);
+		stream->buffer_kind = BUFFER_MAPPED;
+		stream->buffer_align = BUF_HUGE_MIN;
+		stream->buffer_mapped = len;
+		stream->buffer_huge = madvise(start, len, MADV_HUGEPAGE) == 0;
+		return start;
+	}
 
-			/* treat the error */
-			if (count < 0) {
-				stream->error = 1;
-				return 0;
-			}
+	if (posix_memalign(&buffer, align, size))
+		return NULL;
 
-			/* if we do not read anymore, then we should stop */
-			if (count == 0) {
-				if (bytes_to_read > 0) {
-					if (stream->pid != -1)
-						stream->child_at_end = 1;
-					stream->buffer_position++;
-					return nmemb - bytes_to_read / size;
-				}
-				return nmemb;
-			}
+	stream->buffer_kind = BUFFER_HEAP;
+	stream->buffer_align = align;
+	stream->buffer_mapped = 0;
+	stream->buffer_huge = 0;
+	return buffer;
+}
 
-			/* reset buffer and set the buffer and file cursors */
-			stream->buffer_position = 0;
-			if (bytes_to_read > count)
-				stream->cursor += count;
-			else
-				stream->cursor += bytes_to_read;
-			stream->curr_buff_size = count;
-		}
-	}
-	return nmemb;
+static void so_buffer_free(SO_FILE *stream)
+{
+	if (stream->buffer_kind == BUFFER_MAPPED)
+		munmap(stream->buffer, stream->buffer_mapped);
+	else if (stream->buffer_kind == BUFFER_HEAP)
+		free(stream->buffer);
+	stream->buffer = NULL;
 }
 
-size_t so_fwrite(const void *ptr, size_t size, size_t nmemb, SO_FILE *stream)
+/* allocate a stream over an already opened file descriptor */
+static SO_FILE *so_alloc_file(int fd, int mode_flags, int options)
 {
-	int bytes_free;
-	int bytes_to_write = size * nmemb;
-	int ptr_cursor = 0;
+	SO_FILE *file = calloc(1, sizeof(SO_FILE));
+
+	if (file == NULL)
+		return NULL;
+
+	so_init_file(file, fd, mode_flags, options);
 
 	/*
-	 * if we had a read operation before
-	 * then we should reset the buffer
+	 * O_DIRECT transfers need a buffer whose address and
+	 * size are multiples of the block size
 	 */
-	if (stream->read_write == 0) {
-		stream->buffer_position = 0;
-		stream->curr_buff_size = 0;
+	if (options & SO_OPT_DIRECT) {
+		file->direct = 1;
+		file->align = so_direct_align(fd);
+		file->buffer_size = DIRECT_BUF_SIZE;
+		if (file->buffer_size % file->align != 0)
+			file->buffer_size += file->align -
+					     file->buffer_size % file->align;
+	} else if (options & SO_OPT_COMPRESS) {
+		/* compressed streams move whole blocks through the buffer */
+		file->buffer_size = ZBLOCK_SIZE;
 	}
-	stream->read_write = 1;
-
-	/* write to buffer while we have bytes to write */
-	while (bytes_to_write > 0) {
-		/* treat error */
-		if (BUF_SIZE - stream->buffer_position <= 0)
-			return SO_EOF;
 
-		/* the number of bytes that can be written */
-		bytes_free = BUF_SIZE - stream->buffer_position;
-
-		/* similar to read if block - write the bytes to write */
-		if (bytes_free > bytes_to_write) {
-			memcpy(stream->buffer + stream->buffer_position, ptr + ptr_cursor, bytes_to_write);
-			stream->buffer_position += bytes_to_write;
-			ptr_cursor += bytes_to_write;
-			stream->cursor += bytes_to_write;
-			bytes_to_write = 0;
-		/* write the bytes that we can write and flush the buffer */
-		} else {
-			memcpy(stream->buffer + stream->buffer_position, ptr + ptr_cursor, bytes_free);
-			stream->buffer_position += bytes_free;
-			ptr_cursor += bytes_free;
-			bytes_to_write -= bytes_free;
-			so_fflush(stream);
-		}
+	file->buffer = so_buffer_alloc(file, file->buffer_size, file->align,
+				       0);
+	if (file->buffer == NULL) {
+		free(file);
+		return NULL;
 	}
-	return nmemb;
+
+	return file;
 }
 
-int so_fgetc(SO_FILE *stream)
+static void so_free_file(SO_FILE *stream)
 {
-	unsigned char res;
-	int count;
+	int i;
 
-	stream->read_write = 0;
+	if (stream->pcache != NULL) {
+		for (i = 0; i < PCACHE_BLOCKS; i++)
+			free(stream->pcache->blocks[i].data);
+		free(stream->pcache);
+	}
+	if (stream->follow)
+		close(stream->follow_fd);
+	pthread_mutex_destroy(&stream->pcache_lock);
+	pthread_mutex_destroy(&stream->sync_lock);
+	pthread_cond_destroy(&stream->sync_cond);
 
-	/* if the buffer is empty or if it is filled, then we should read more */
-	if ((stream->buffer_position == stream->curr_buff_size) || (stream->cursor == 0)) {
-		count = read(stream->fd, stream->buffer, BUF_SIZE);
-		if (count == 0 || count == -1) {
-			stream->buffer_position++;
-			return SO_EOF;
-		}
+	so_buffer_free(stream);
 
-		stream->buffer_position = 0;
-		stream->cursor += count;
-		stream->curr_buff_size = count;
+	if (stream->slab != NULL) {
+		if (__atomic_sub_fetch(&stream->slab->refs, 1,
+				       __ATOMIC_ACQ_REL) == 0)
+			free(stream->slab);
+		return;
 	}
-	/* return the last byte */
-	res = (unsigned char) stream->buffer[stream->buffer_position++];
 
-	return (int) res;
+	free(stream->pathname);
+	free(stream);
 }
 
-int so_fputc(int c, SO_FILE *stream)
+/* turn O_DIRECT on or off for the file descriptor of the stream */
+static int so_set_direct(SO_FILE *stream, int on)
 {
-	int res;
-
-	stream->read_write = 1;
+	int flags = fcntl(stream->fd, F_GETFL);
 
-	/* copy one byte to the buffer */
-	memcpy(stream->buffer + stream->buffer_position, (char *) &c, 1);
-
-	stream->buffer_position++;
+	if (flags == -1)
+		return -1;
 
-	/*
-	 * if we reached the end of the buffer
-	 * then we should flush the buffer
-	 */
-	if (stream->buffer_position == BUF_SIZE)
-		so_fflush(stream);
+	flags = on ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
 
-	return c;
+	return fcntl(stream->fd, F_SETFL, flags);
 }
 
-int so_feof(SO_FILE *stream)
+/*
+ * the extent of the file at offset: sets *hole and returns the number of
+ * bytes of data (or hole) from offset, 0 at the end of the file and -1
+ * on errors; the probes move the cursor of the descriptor
+ */
+static long so_sparse_extent(SO_FILE *stream, long offset, int *hole)
 {
-	int current_cursor;
-	int current_position;
-	int res;
+	struct stat st;
+	long next;
 
-	/* return if the child process got to the end */
-	if (stream->pid != -1 && stream->child_at_end == 1)
-		return 1;
-
-	/* compare the current cursor with the number of bytes to the end */
-	current_cursor = so_ftell(stream);
-	current_position = stream->buffer_position + current_cursor - stream->curr_buff_size;
-	res = lseek(stream->fd, 0, SEEK_END);
-
-	if (res == -1)
-		return 0;
+	if ((offset < stream->data_start || offset >= stream->data_end) &&
+	    (offset < stream->hole_start || offset >= stream->hole_end)) {
+		errno = 0;
+		next = lseek(stream->fd, offset, SEEK_DATA);
+		if (next == -1 && errno != ENXIO)
+			return -1;
 
-	if (res < current_position)
-		return 1;
+		if (next == -1) {
+			/* a hole up to the end of the file, or past it */
+			if (fstat(stream->fd, &st) == -1)
+				return -1;
+			if (offset >= st.st_size)
+				return 0;
+			stream->hole_start = offset;
+			stream->hole_end = st.st_size;
+		} else if (next > offset) {
+			stream->hole_start = offset;
+			stream->hole_end = next;
+		} else {
+			/* there is always a hole at the end of the file */
+			next = lseek(stream->fd, offset, SEEK_HOLE);
+			if (next == -1)
+				return -1;
+			stream->data_start = offset;
+			stream->data_end = next;
+		}
+	}
 
-	/* put the actual cursor where it was */
-	res = lseek(stream->fd, current_cursor, SEEK_SET);
+	*hole = offset >= stream->hole_start && offset < stream->hole_end;
+	if (*hole)
+		return stream->hole_end - offset;
+	return stream->data_end - offset;
+}
 
-	return 0;
+/* the ranges found by so_sparse_extent are not valid after a write */
+static void so_sparse_forget(SO_FILE *stream)
+{
+	stream->data_end = stream->data_start;
+	stream->hole_end = stream->hole_start;
 }
 
-int so_ferror(SO_FILE *stream)
+/*
+ * drop the so_pread blocks that overlap [offset, offset + count), done by
+ * every write that reaches the file so the cache never serves old data
+ */
+static void so_pcache_invalidate(SO_FILE *stream, long offset, size_t count)
+{
+	struct so_pcache_block *block;
+	int i;
+
+	pthread_mutex_lock(&stream->pcache_lock);
+
+	for (i = 0; stream->pcache != NULL && i < PCACHE_BLOCKS; i++) {
+		block = &stream->pcache->blocks[i];
+		if (block->offset != -1 &&
+		    block->offset < offset + (long)count &&
+		    offset < block->offset + PCACHE_BLOCK_SIZE)
+			block->offset = -1;
+	}
+
+	pthread_mutex_unlock(&stream->pcache_lock);
+}
+
+/*
+ * read and write wrappers - an O_DIRECT transfer that is not aligned
+ * (e.g. the end of a file opened in append mode) fails with EINVAL,
+ * so it is retried through the page cache
+ */
+static ssize_t so_sys_read(SO_FILE *stream, void *buf, size_t count)
+{
+	ssize_t res;
+
+	if (stream->cookie_io)
+		return stream->io.read ? stream->io.read(stream->cookie, buf,
+							 count) : -1;
+
+	errno = 0;
+	res = read(stream->fd, buf, count);
+	if (res == -1 && errno == EINVAL && stream->direct) {
+		if (so_set_direct(stream, 0) == -1)
+			return -1;
+		res = read(stream->fd, buf, count);
+		so_set_direct(stream, 1);
+	}
+
+	return res;
+}
+
+static ssize_t so_sys_write(SO_FILE *stream, const void *buf, size_t count)
+{
+	ssize_t res;
+
+	so_sparse_forget(stream);
+
+	if (stream->cookie_io)
+		return stream->io.write ? stream->io.write(stream->cookie, buf,
+							   count) : -1;
+
+	/* in append mode the kernel picks the offset */
+	if (stream->mode & O_APPEND)
+		so_pcache_invalidate(stream, 0, LONG_MAX);
+	else
+		so_pcache_invalidate(stream, stream->file_offset, count);
+
+	errno = 0;
+	res = write(stream->fd, buf, count);
+	if (res == -1 && errno == EINVAL && stream->direct) {
+		if (so_set_direct(stream, 0) == -1)
+			return -1;
+		res = write(stream->fd, buf, count);
+		so_set_direct(stream, 1);
+	}
+
+	return res;
+}
+
+static long so_sys_lseek(SO_FILE *stream, long offset, int whence)
+{
+	if (stream->cookie_io) {
+		if (stream->io.seek == NULL ||
+		    stream->io.seek(stream->cookie, &offset, whence) == -1)
+			return -1;
+		return offset;
+	}
+
+	return lseek(stream->fd, offset, whence);
+}
+
+static int so_sys_close(SO_FILE *stream)
+{
+	if (stream->cookie_io)
+		return stream->io.close ? stream->io.close(stream->cookie) : 0;
+
+	return close(stream->fd);
+}
+
+static ssize_t so_sys_pread(SO_FILE *stream, void *buf, size_t count,
+			    long offset)
+{
+	ssize_t res;
+
+	errno = 0;
+	res = pread(stream->fd, buf, count, offset);
+	if (res == -1 && errno == EINVAL && stream->direct) {
+		if (so_set_direct(stream, 0) == -1)
+			return -1;
+		res = pread(stream->fd, buf, count, offset);
+		so_set_direct(stream, 1);
+	}
+
+	return res;
+}
+
+static ssize_t so_sys_pwrite(SO_FILE *stream, const void *buf, size_t count,
+			     long offset)
+{
+	ssize_t res;
+
+	so_sparse_forget(stream);
+	so_pcache_invalidate(stream, offset, count);
+
+	errno = 0;
+	res = pwrite(stream->fd, buf, count, offset);
+	if (res == -1 && errno == EINVAL && stream->direct) {
+		if (so_set_direct(stream, 0) == -1)
+			return -1;
+		res = pwrite(stream->fd, buf, count, offset);
+		so_set_direct(stream, 1);
+	}
+
+	return res;
+}
+
+/* the last transfer failed only because the descriptor was not ready */
+static int so_would_block(SO_FILE *stream)
+{
+	return stream->nonblock && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * reserve the space of the next count bytes ahead of the writes, with
+ * FALLOC_FL_KEEP_SIZE so the size of the file (and the offset of appends)
+ * does not change; each extent is as large as the data before it, from
+ * PREALLOC_MIN to PREALLOC_MAX, and at least reaches the size hint
+ */
+static void so_prealloc(SO_FILE *stream, long count)
+{
+	struct stat st;
+	long end, extent, new_end;
+
+	if (stream->prealloc < 0 || stream->cookie_io || stream->mem)
+		return;
+
+	/* appenders turn the policy on once they wrote PREALLOC_MIN bytes */
+	if (stream->prealloc == 0) {
+		if (!(stream->mode & O_APPEND) ||
+		    stream->file_offset + count < PREALLOC_MIN)
+			return;
+		stream->prealloc = 1;
+	}
+
+	if (stream->prealloc_base + stream->file_offset + count <=
+	    stream->prealloc_end)
+		return;
+
+	/*
+	 * the file_offset of an appender counts the bytes it wrote, the
+	 * end of the file is found again as other writers may append too
+	 */
+	if (stream->mode & O_APPEND) {
+		if (fstat(stream->fd, &st) == -1)
+			return;
+		stream->prealloc_base = st.st_size - stream->file_offset;
+	}
+
+	end = stream->prealloc_base + stream->file_offset + count;
+	if (end <= stream->prealloc_end)
+		return;
+
+	extent = end;
+	if (extent < PREALLOC_MIN)
+		extent = PREALLOC_MIN;
+	if (extent > PREALLOC_MAX)
+		extent = PREALLOC_MAX;
+	new_end = (end + extent + PREALLOC_MIN - 1) / PREALLOC_MIN *
+		  PREALLOC_MIN;
+	if (new_end < stream->prealloc_hint)
+		new_end = stream->prealloc_hint;
+
+	if (stream->prealloc_end > end)
+		end = stream->prealloc_end;
+
+	/* the file system does not support it, stop trying */
+	if (fallocate(stream->fd, FALLOC_FL_KEEP_SIZE, end,
+		      new_end - end) == -1) {
+		stream->prealloc = -1;
+		return;
+	}
+	stream->prealloc_end = new_end;
+}
+
+/*
+ * give back the space reserved past the end of the file; truncating at
+ * the same size frees the blocks past it on ext4 and xfs. an appender
+ * leaves them if the file grew by more than what it wrote, as another
+ * writer may still be using them
+ */
+static void so_prealloc_trim(SO_FILE *stream)
+{
+	struct stat st;
+
+	if (stream->prealloc_end == 0 || fstat(stream->fd, &st) == -1 ||
+	    st.st_size >= stream->prealloc_end)
+		return;
+
+	if ((stream->mode & O_APPEND) &&
+	    st.st_size != stream->prealloc_base + stream->file_offset)
+		return;
+
+	ftruncate(stream->fd, st.st_size);
+}
+
+/*
+ * write the unaligned tail of a direct stream through the page cache,
+ * at the given offset, without moving the cursor of the file descriptor
+ */
+static int so_write_tail(SO_FILE *stream, const char *buf, int count,
+			 long offset)
+{
+	int res = 0;
+
+	if (so_set_direct(stream, 0) == -1)
+		return -1;
+
+	while (count > 0) {
+		if (stream->mode & O_APPEND)
+			res = write(stream->fd, buf, count);
+		else
+			res = pwrite(stream->fd, buf, count, offset);
+		if (res == -1)
+			break;
+		buf += res;
+		count -= res;
+		offset += res;
+	}
+
+	so_set_direct(stream, 1);
+
+	return res == -1 ? -1 : 0;
+}
+
+/*
+ * refill the buffer from the cursor of the file descriptor; for direct
+ * streams that cursor may be behind the logical one (it is kept aligned)
+ * and the bytes in between are skipped. the bytes not consumed yet (when
+ * looking ahead) are kept: they move to the beginning of the buffer (its
+ * block, for direct streams) and the new data is read after them
+ */
+static int so_fill_buffer(SO_FILE *stream)
+{
+	long extent = 0;
+	int count, hole = 0;
+	int keep = stream->curr_buff_size - stream->buffer_position;
+	int shift = stream->buffer_position -
+		    stream->buffer_position % stream->align;
+	int start = 0;
+	int skip = stream->cursor - stream->file_offset;
+	int size;
+	long avail = stream->limit - stream->file_offset;
+
+	if (keep > 0) {
+		memmove(stream->buffer, stream->buffer + shift,
+			stream->curr_buff_size - shift);
+		stream->buffer_position -= shift;
+		stream->curr_buff_size -= shift;
+		start = stream->curr_buff_size;
+		skip = 0;
+	}
+	size = stream->buffer_size - start;
+
+	if (avail < 0)
+		avail = 0;
+
+	/* do not read past the limit, up to the alignment of direct I/O */
+	if (stream->limit >= 0 && avail < size) {
+		size = avail;
+		if (size % stream->align != 0)
+			size += stream->align - size % stream->align;
+	}
+
+	/* reads stop at the end of the data or hole at file_offset */
+	if (stream->sparse && size > 0) {
+		extent = so_sparse_extent(stream, stream->file_offset, &hole);
+		if (extent > 0 && extent < size)
+			size = extent;
+	}
+
+	if (size == 0)
+		count = 0;
+	else if (stream->sparse && extent > 0 && hole) {
+		/* the holes are read with no syscall */
+		memset(stream->buffer + start, 0, size);
+		count = size;
+	}
+	else if (stream->positional)
+		count = so_sys_pread(stream, stream->buffer + start, size,
+				     stream->file_offset);
+	else
+		count = so_sys_read(stream, stream->buffer + start, size);
+
+	/* treat the error; no data yet is not one for non-blocking streams */
+	if (count < 0) {
+		if (!so_would_block(stream))
+			stream->error = 1;
+		return -1;
+	}
+
+	if (stream->limit >= 0 && count > avail)
+		count = avail;
+
+	stream->file_offset += count;
+
+	/* if we do not read anymore, then we got to the end of the file */
+	if (count <= skip) {
+		stream->eof = 1;
+		if (keep == 0) {
+			stream->buffer_position = 0;
+			stream->curr_buff_size = 0;
+		}
+		return 0;
+	}
+
+	if (keep > 0) {
+		stream->curr_buff_size += count;
+		return count;
+	}
+
+	stream->buffer_position = skip;
+	stream->curr_buff_size = count;
+
+	return count - skip;
+}
+
+/*
+ * a direct stream writes whole blocks only, so when it starts writing in
+ * the middle of a block it first brings the beginning of that block
+ * in the buffer; the block is read aside, so the bytes after the head
+ * (records reserved in place) are kept
+ */
+static void so_load_head(SO_FILE *stream)
+{
+	int skip = stream->cursor - stream->file_offset;
+	void *block;
+	int res = -1;
+
+	if (posix_memalign(&block, stream->align, stream->align) == 0) {
+		res = pread(stream->fd, block, stream->align,
+			    stream->file_offset);
+		if (res >= 0) {
+			if (res > skip)
+				res = skip;
+			memcpy(stream->buffer, block, res);
+			memset(stream->buffer + res, 0, skip - res);
+			stream->buffer_position = skip;
+		}
+		free(block);
+	}
+	if (res >= 0)
+		return;
+
+	/* the file is not readable, fall back to an unaligned cursor */
+	if (so_sys_lseek(stream, stream->cursor, SEEK_SET) != -1)
+		stream->file_offset = stream->cursor;
+}
+
+/* where the next byte goes, before the head of its block is loaded */
+static int so_head_skip(SO_FILE *stream)
+{
+	if (stream->direct && stream->buffer_position == 0 &&
+	    stream->cursor != stream->file_offset)
+		return stream->cursor - stream->file_offset;
+
+	return 0;
+}
+
+/*
+ * change the direction of the stream: pending writes are flushed and
+ * data read ahead is dropped, moving the cursor of the file descriptor
+ * back where the logical cursor is
+ */
+static int so_switch_mode(SO_FILE *stream, int read_write)
+{
+	long target;
+
+	/* read/write streams do not change direction */
+	if (stream->read_write == read_write || stream->unified)
+		return 0;
+
+	/* shared writers only write */
+	if (stream->shared != NULL)
+		return -1;
+
+	if (stream->read_write == 1 && so_fflush(stream) == SO_EOF)
+		return -1;
+
+	if (stream->read_write == 0) {
+		target = stream->cursor;
+		if (stream->direct)
+			target -= target % stream->align;
+		if (target != stream->file_offset && !stream->positional &&
+		    so_sys_lseek(stream, target, SEEK_SET) == -1) {
+			stream->error = 1;
+			return -1;
+		}
+		stream->file_offset = target;
+	}
+
+	stream->buffer_position = 0;
+	stream->buffer_synced = 0;
+	stream->curr_buff_size = 0;
+	stream->read_write = read_write;
+
+	return 0;
+}
+
+/*
+ * the buffer of so_open_memstream is always terminated by a null byte
+ * (which is not counted in its size) and the size is that of the data
+ * before the cursor
+ */
+static void so_memstream_publish(SO_FILE *stream)
+{
+	stream->buffer[stream->curr_buff_size] = '\0';
+	*stream->memstream_ptr = stream->buffer;
+	*stream->memstream_size = stream->cursor < stream->curr_buff_size ?
+				  stream->cursor : stream->curr_buff_size;
+}
+
+/*
+ * make room for size bytes in the buffer of a memory stream; only
+ * so_open_memstream streams can grow
+ */
+static int so_mem_grow(SO_FILE *stream, long size)
+{
+	long capacity = stream->buffer_size;
+	char *buffer;
+
+	if (stream->memstream_ptr == NULL || size > INT_MAX - 1)
+		return -1;
+
+	while (capacity < size)
+		capacity = capacity * 2 > INT_MAX - 1 ? INT_MAX - 1 :
+						       capacity * 2;
+
+	/* one more byte for the null terminator */
+	buffer = realloc(stream->buffer, capacity + 1);
+	if (buffer == NULL) {
+		stream->error = 1;
+		return -1;
+	}
+
+	stream->buffer = buffer;
+	stream->buffer_size = capacity;
+	so_memstream_publish(stream);
+
+	return 0;
+}
+
+/*
+ * seeking in a memory stream; moving past the data fills the gap
+ * with zeros
+ */
+static int so_mem_seek(SO_FILE *stream, long offset, int whence)
+{
+	if (whence == SEEK_END)
+		offset += stream->curr_buff_size;
+	else if (whence != SEEK_SET)
+		return -1;
+
+	if (offset < 0)
+		return -1;
+
+	if (offset > stream->buffer_size && so_mem_grow(stream, offset) == -1)
+		return -1;
+
+	if (offset > stream->curr_buff_size) {
+		memset(stream->buffer + stream->curr_buff_size, 0,
+		       offset - stream->curr_buff_size);
+		stream->curr_buff_size = offset;
+	}
+
+	stream->buffer_position = offset;
+	stream->cursor = offset;
+	stream->eof = 0;
+	if (stream->memstream_ptr != NULL)
+		so_memstream_publish(stream);
+
+	return 0;
+}
+
+/*
+ * write the dirty range of the window of a read/write stream; write() is
+ * used when the descriptor is already there, pwrite() otherwise so the
+ * descriptor does not have to be moved
+ */
+static int so_flush_dirty(SO_FILE *stream)
+{
+	long offset = stream->cursor - stream->buffer_position +
+		      stream->dirty_start;
+	char *buf = stream->buffer + stream->dirty_start;
+	int count = stream->dirty_end - stream->dirty_start;
+	ssize_t res;
+
+	/* memory streams are always up to date, they only publish the size */
+	if (stream->mem) {
+		if (stream->memstream_ptr != NULL)
+			so_memstream_publish(stream);
+		stream->dirty_start = 0;
+		stream->dirty_end = 0;
+		return 0;
+	}
+
+	while (count > 0) {
+		if (stream->file_offset == offset) {
+			res = so_sys_write(stream, buf, count);
+			if (res > 0)
+				stream->file_offset += res;
+		} else {
+			res = so_sys_pwrite(stream, buf, count, offset);
+		}
+
+		if (res <= 0) {
+			stream->error = 1;
+			return SO_EOF;
+		}
+
+		buf += res;
+		count -= res;
+		offset += res;
+		stream->dirty_start += res;
+	}
+
+	stream->dirty_start = 0;
+	stream->dirty_end = 0;
+
+	return 0;
+}
+
+/* move the window of a read/write stream to the cursor and fill it */
+static int so_unified_fill(SO_FILE *stream)
+{
+	long target;
+
+	if (so_flush_dirty(stream) == SO_EOF)
+		return -1;
+
+	/* the window goes on after the bytes not consumed yet */
+	target = stream->cursor + stream->curr_buff_size -
+		 stream->buffer_position;
+	if (stream->file_offset != target) {
+		if (so_sys_lseek(stream, target, SEEK_SET) == -1) {
+			stream->error = 1;
+			return -1;
+		}
+		stream->file_offset = target;
+	}
+
+	return so_fill_buffer(stream);
+}
+
+/*
+ * the file of a follow stream was replaced at its path (rotated): the old
+ * one was read to its end, so the stream goes on with the new one
+ */
+static int so_follow_reopen(SO_FILE *stream)
+{
+	int fd = open(stream->pathname, O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1)
+		return -1;
+
+	inotify_rm_watch(stream->follow_fd, stream->follow_wd);
+	stream->follow_wd = inotify_add_watch(stream->follow_fd,
+					      stream->pathname,
+					      FOLLOW_FILE_EVENTS);
+	close(stream->fd);
+	stream->fd = fd;
+	/* the bytes looked ahead at come before the new file */
+	stream->cursor = stream->buffer_position - stream->curr_buff_size;
+	stream->file_offset = 0;
+
+	return 0;
+}
+
+/*
+ * wait at the end of the file of a follow stream until it grows, is
+ * truncated (start over) or is replaced; the events only wake the
+ * stream up, the file itself tells what changed
+ */
+static int so_follow_wait(SO_FILE *stream)
+{
+	char events[4096] __attribute__((aligned(8)));
+	struct stat st_path, st_fd;
+	struct pollfd pfd;
+	ssize_t res;
+
+	for (;;) {
+		if (fstat(stream->fd, &st_fd) == -1)
+			return -1;
+
+		if (st_fd.st_size > stream->file_offset)
+			return 0;
+
+		if (st_fd.st_size < stream->file_offset) {
+			if (so_sys_lseek(stream, 0, SEEK_SET) == -1)
+				return -1;
+			stream->cursor = stream->buffer_position -
+					 stream->curr_buff_size;
+			stream->file_offset = 0;
+			return 0;
+		}
+
+		if (stat(stream->pathname, &st_path) == 0 &&
+		    (st_path.st_ino != st_fd.st_ino ||
+		     st_path.st_dev != st_fd.st_dev) &&
+		    so_follow_reopen(stream) == 0)
+			return 0;
+
+		/* the events queued since the last check are consumed */
+		res = read(stream->follow_fd, events, sizeof(events));
+		if (res > 0)
+			continue;
+		if (res == -1 && errno != EAGAIN)
+			return -1;
+
+		if (stream->nonblock) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		pfd.fd = stream->follow_fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+			return -1;
+	}
+}
+
+/* follow streams wait for more data instead of stopping at the end */
+static int so_follow_fill(SO_FILE *stream)
+{
+	int count;
+
+	for (;;) {
+		count = so_fill_buffer(stream);
+		if (count != 0)
+			return count;
+
+		stream->eof = 0;
+		if (so_follow_wait(stream) == -1) {
+			if (!so_would_block(stream))
+				stream->error = 1;
+			return -1;
+		}
+	}
+}
+
+/* refill the buffer once it was consumed */
+static int so_refill(SO_FILE *stream)
+{
+	/* all the data of a memory stream is in the buffer already */
+	if (stream->mem) {
+		stream->eof = 1;
+		return 0;
+	}
+
+	if (stream->unified)
+		return so_unified_fill(stream);
+
+	if (stream->follow)
+		return so_follow_fill(stream);
+
+	return so_fill_buffer(stream);
+}
+
+/*
+ * writes of a read/write stream modify the window in place and extend
+ * the dirty range; the window moves to the cursor once it is full
+ */
+static size_t so_unified_fwrite(const void *ptr, size_t size, size_t nmemb,
+				SO_FILE *stream, size_t *done)
+{
+	size_t bytes_to_write = size * nmemb;
+	size_t ptr_cursor = 0;
+	int count;
+
+	*done = 0;
+
+	/* the memory of a read only memory stream cannot be written */
+	if (stream->mem && (stream->mode & O_ACCMODE) == O_RDONLY) {
+		stream->error = 1;
+		return 0;
+	}
+
+	while (bytes_to_write > 0) {
+		/* memory streams grow or stop at the end of their memory */
+		if (stream->mem &&
+		    stream->buffer_position == stream->buffer_size &&
+		    so_mem_grow(stream, stream->buffer_position +
+				bytes_to_write) == -1)
+			return ptr_cursor / size;
+
+		count = stream->buffer_size - stream->buffer_position;
+		if ((size_t)count > bytes_to_write)
+			count = bytes_to_write;
+
+		so_copy(stream->buffer + stream->buffer_position,
+			(const char *)ptr + ptr_cursor, count);
+
+		if (stream->dirty_start == stream->dirty_end) {
+			stream->dirty_start = stream->buffer_position;
+			stream->dirty_end = stream->buffer_position + count;
+		} else {
+			if (stream->buffer_position < stream->dirty_start)
+				stream->dirty_start = stream->buffer_position;
+			if (stream->buffer_position + count > stream->dirty_end)
+				stream->dirty_end = stream->buffer_position +
+						    count;
+		}
+
+		stream->buffer_position += count;
+		stream->cursor += count;
+		if (stream->buffer_position > stream->curr_buff_size)
+			stream->curr_buff_size = stream->buffer_position;
+		ptr_cursor += count;
+		bytes_to_write -= count;
+		*done = ptr_cursor;
+
+		/* flush the window once it is full */
+		if (stream->buffer_position == stream->buffer_size &&
+		    !stream->mem) {
+			if (so_flush_dirty(stream) == SO_EOF)
+				return ptr_cursor / size;
+			stream->buffer_position = 0;
+			stream->curr_buff_size = 0;
+		}
+	}
+
+	return nmemb;
+}
+
+/*
+ * set up the shared writer state; the data is written with pwrite at
+ * reserved offsets, so append mode is emulated by starting at the end
+ */
+static int so_shared_init(SO_FILE *stream, int append)
+{
+	struct so_shared *shared = calloc(1, sizeof(struct so_shared));
+	struct stat st;
+
+	if (shared == NULL)
+		return -1;
+
+	if (append && fstat(stream->fd, &st) == 0)
+		shared->offset = st.st_size;
+
+	if (pthread_key_create(&shared->key, NULL) != 0) {
+		free(shared);
+		return -1;
+	}
+	pthread_mutex_init(&shared->lock, NULL);
+	pthread_cond_init(&shared->idle, NULL);
+
+	stream->shared = shared;
+	stream->read_write = 1;
+
+	return 0;
+}
+
+/* the private buffer of the calling thread, created on first use */
+static struct so_wbuf *so_shared_buffer(struct so_shared *shared)
+{
+	struct so_wbuf *wbuf = pthread_getspecific(shared->key);
+
+	if (wbuf != NULL)
+		return wbuf;
+
+	wbuf = calloc(1, sizeof(struct so_wbuf));
+	if (wbuf == NULL)
+		return NULL;
+	wbuf->data = malloc(SHARED_BUF_SIZE);
+	if (wbuf->data == NULL) {
+		free(wbuf);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&shared->lock);
+	wbuf->next = shared->bufs;
+	shared->bufs = wbuf;
+	pthread_mutex_unlock(&shared->lock);
+
+	pthread_setspecific(shared->key, wbuf);
+
+	return wbuf;
+}
+
+/* reserve a range of the file for count bytes and write them there */
+static int so_shared_write(SO_FILE *stream, const char *buf, size_t count)
+{
+	struct so_shared *shared = stream->shared;
+	long offset;
+	ssize_t res = 0;
+
+	if (count == 0)
+		return 0;
+
+	__atomic_add_fetch(&shared->inflight, 1, __ATOMIC_ACQ_REL);
+	offset = __atomic_fetch_add(&shared->offset, (long)count,
+				    __ATOMIC_RELAXED);
+
+	while (count > 0) {
+		res = pwrite(stream->fd, buf, count, offset);
+		if (res <= 0)
+			break;
+		buf += res;
+		count -= res;
+		offset += res;
+	}
+
+	/* wake up so_fclose if it waits for this write */
+	if (__atomic_sub_fetch(&shared->inflight, 1, __ATOMIC_ACQ_REL) == 0) {
+		pthread_mutex_lock(&shared->lock);
+		pthread_cond_broadcast(&shared->idle);
+		pthread_mutex_unlock(&shared->lock);
+	}
+
+	if (res <= 0) {
+		stream->error = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int so_shared_flush(SO_FILE *stream, struct so_wbuf *wbuf)
+{
+	int res = so_shared_write(stream, wbuf->data, wbuf->size);
+
+	wbuf->size = 0;
+
+	return res;
+}
+
+/*
+ * the data of one so_fwrite call is never split between two
+ * reservations, so the records of different threads do not mix
+ */
+static size_t so_shared_fwrite(const void *ptr, size_t size, size_t nmemb,
+			       SO_FILE *stream)
+{
+	struct so_wbuf *wbuf = so_shared_buffer(stream->shared);
+	size_t count = size * nmemb;
+
+	if (wbuf == NULL) {
+		stream->error = 1;
+		return 0;
+	}
+
+	if (count > (size_t)(SHARED_BUF_SIZE - wbuf->size) &&
+	    so_shared_flush(stream, wbuf) == -1)
+		return 0;
+
+	/* too large for the buffer, written straight from the caller */
+	if (count > SHARED_BUF_SIZE)
+		return so_shared_write(stream, ptr, count) == -1 ? 0 : nmemb;
+
+	memcpy(wbuf->data + wbuf->size, ptr, count);
+	wbuf->size += count;
+
+	if (wbuf->size == SHARED_BUF_SIZE && so_shared_flush(stream, wbuf) == -1)
+		return 0;
+
+	return nmemb;
+}
+
+/*
+ * flush the buffers of all the threads, wait for the writes in flight
+ * and release the shared writer state
+ */
+static int so_shared_close(SO_FILE *stream)
+{
+	struct so_shared *shared = stream->shared;
+	struct so_wbuf *wbuf, *next;
+	int res = 0;
+
+	for (wbuf = shared->bufs; wbuf != NULL; wbuf = wbuf->next) {
+		if (so_shared_flush(stream, wbuf) == -1)
+			res = -1;
+	}
+
+	pthread_mutex_lock(&shared->lock);
+	while (__atomic_load_n(&shared->inflight, __ATOMIC_ACQUIRE) > 0)
+		pthread_cond_wait(&shared->idle, &shared->lock);
+	pthread_mutex_unlock(&shared->lock);
+
+	for (wbuf = shared->bufs; wbuf != NULL; wbuf = next) {
+		next = wbuf->next;
+		free(wbuf->data);
+		free(wbuf);
+	}
+
+	pthread_key_delete(shared->key);
+	pthread_mutex_destroy(&shared->lock);
+	pthread_cond_destroy(&shared->idle);
+	free(shared);
+	stream->shared = NULL;
+
+	return res;
+}
+
+static void so_z_put32(unsigned char *p, unsigned int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static unsigned int so_z_get32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+/* the part of a length that does not fit in the 4 bits of the token */
+static unsigned char *so_lz_put_len(unsigned char *op, int len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+
+	return op;
+}
+
+/*
+ * LZ77 in the style of LZ4: a sequence is a token (number of literals in
+ * the high 4 bits, match length - 4 in the low ones, 15 meaning that more
+ * length bytes follow), the literals, the 16 bit offset of the match and
+ * the rest of its length; the last sequence has literals only. returns
+ * the size of the output or -1 if it does not fit in cap bytes
+ */
+static int so_lz_compress(int *hash, const unsigned char *src, int len,
+			  unsigned char *dst, int cap)
+{
+	unsigned char *op = dst, *end = dst + cap;
+	int ip = 0, anchor = 0, misses = 0;
+	int ref, lit, mlen;
+	unsigned int seq, h;
+	unsigned long long a, b;
+
+	memset(hash, -1, sizeof(int) << ZHASH_BITS);
+
+	while (ip + 4 <= len) {
+		memcpy(&seq, src + ip, 4);
+		h = (seq * 2654435761u) >> (32 - ZHASH_BITS);
+		ref = hash[h];
+		hash[h] = ip;
+
+		if (ref < 0 || ip - ref > 0xffff ||
+		    memcmp(src + ref, src + ip, 4) != 0) {
+			/* step faster over data that does not compress */
+			ip += 1 + (misses++ >> 5);
+			continue;
+		}
+		misses = 0;
+
+		/* extend the match 8 bytes at a time */
+		mlen = 4;
+		while (ip + mlen + 8 <= len) {
+			memcpy(&a, src + ref + mlen, 8);
+			memcpy(&b, src + ip + mlen, 8);
+			if (a != b)
+				break;
+			mlen += 8;
+		}
+		while (ip + mlen < len && src[ref + mlen] == src[ip + mlen])
+			mlen++;
+
+		lit = ip - anchor;
+		if (end - op < lit + lit / 255 + mlen / 255 + 8)
+			return -1;
+
+		*op++ = (lit < 15 ? lit : 15) << 4 |
+			(mlen - 4 < 15 ? mlen - 4 : 15);
+		if (lit >= 15)
+			op = so_lz_put_len(op, lit - 15);
+		memcpy(op, src + anchor, lit);
+		op += lit;
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+		if (mlen - 4 >= 15)
+			op = so_lz_put_len(op, mlen - 4 - 15);
+
+		ip += mlen;
+		anchor = ip;
+	}
+
+	lit = len - anchor;
+	if (end - op < lit + lit / 255 + 2)
+		return -1;
+
+	*op++ = (lit < 15 ? lit : 15) << 4;
+	if (lit >= 15)
+		op = so_lz_put_len(op, lit - 15);
+	memcpy(op, src + anchor, lit);
+	op += lit;
+
+	return op - dst;
+}
+
+/* returns the size of the output or -1 if the input is corrupted */
+static int so_lz_decompress(const unsigned char *src, int len,
+			    unsigned char *dst, int cap)
+{
+	const unsigned char *ip = src, *iend = src + len;
+	unsigned char *op = dst, *oend = dst + cap;
+	int lit, mlen, off, b;
+
+	while (ip < iend) {
+		b = *ip++;
+		lit = b >> 4;
+		mlen = (b & 15) + 4;
+
+		if (lit == 15) {
+			do {
+				if (ip == iend)
+					return -1;
+				b = *ip++;
+				lit += b;
+			} while (b == 255);
+		}
+
+		if (iend - ip < lit || oend - op < lit)
+			return -1;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+
+		/* the last sequence has no match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+
+		if (mlen == 19) {
+			do {
+				if (ip == iend)
+					return -1;
+				b = *ip++;
+				mlen += b;
+			} while (b == 255);
+		}
+
+		if (off == 0 || off > op - dst || oend - op < mlen)
+			return -1;
+
+		/* a match may overlap the bytes it produces */
+		if (off >= mlen) {
+			memcpy(op, op - off, mlen);
+			op += mlen;
+		} else {
+			for (; mlen > 0; mlen--, op++)
+				*op = op[-off];
+		}
+	}
+
+	return op - dst;
+}
+
+/* write a block, compressed when that makes it smaller */
+static int so_z_emit(struct so_zstream *z, const char *data, int len)
+{
+	unsigned char *hdr = (unsigned char *)z->packed;
+	int size, done, res;
+
+	size = so_lz_compress(z->hash, (const unsigned char *)data, len,
+			      hdr + ZHDR_SIZE, len - 1);
+	memcpy(hdr, "SZB", 3);
+	if (size < 0) {
+		hdr[3] = ZCODEC_STORED;
+		memcpy(hdr + ZHDR_SIZE, data, len);
+		size = len;
+	} else {
+		hdr[3] = ZCODEC_LZ;
+	}
+	so_z_put32(hdr + 4, len);
+	so_z_put32(hdr + 8, size);
+
+	size += ZHDR_SIZE;
+	for (done = 0; done < size; done += res) {
+		res = write(z->fd, z->packed + done, size - done);
+		if (res <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* the worker compresses and writes the blocks handed to it in pending */
+static void *so_z_worker(void *arg)
+{
+	struct so_zstream *z = arg;
+	int res;
+
+	pthread_mutex_lock(&z->lock);
+	for (;;) {
+		while (z->pending_len == 0 && !z->stop)
+			pthread_cond_wait(&z->cond, &z->lock);
+		if (z->pending_len == 0)
+			break;
+		pthread_mutex_unlock(&z->lock);
+
+		res = so_z_emit(z, z->pending, z->pending_len);
+
+		pthread_mutex_lock(&z->lock);
+		if (res == -1)
+			z->worker_error = 1;
+		z->pending_len = 0;
+		pthread_cond_broadcast(&z->cond);
+	}
+	pthread_mutex_unlock(&z->lock);
+
+	return NULL;
+}
+
+/*
+ * write the data gathered in raw as a block; a threaded stream swaps
+ * raw with the block the worker is done with, so the compression of
+ * one block overlaps with the writes that fill the next one
+ */
+static int so_z_push(struct so_zstream *z)
+{
+	char *tmp;
+	int res = 0;
+
+	if (z->raw_len == 0)
+		return 0;
+
+	if (!z->threaded) {
+		res = so_z_emit(z, z->raw, z->raw_len);
+	} else {
+		pthread_mutex_lock(&z->lock);
+		while (z->pending_len > 0)
+			pthread_cond_wait(&z->cond, &z->lock);
+		tmp = z->pending;
+		z->pending = z->raw;
+		z->raw = tmp;
+		z->pending_len = z->raw_len;
+		pthread_cond_broadcast(&z->cond);
+		if (z->worker_error)
+			res = -1;
+		pthread_mutex_unlock(&z->lock);
+	}
+
+	z->raw_start += z->raw_len;
+	z->raw_len = 0;
+
+	return res;
+}
+
+/* write the partial block and wait for the worker to write it */
+static int so_z_flush(struct so_zstream *z)
+{
+	int res = so_z_push(z);
+
+	if (z->threaded) {
+		pthread_mutex_lock(&z->lock);
+		while (z->pending_len > 0)
+			pthread_cond_wait(&z->cond, &z->lock);
+		if (z->worker_error)
+			res = -1;
+		pthread_mutex_unlock(&z->lock);
+	}
+
+	return res;
+}
+
+/* read the header of the next block not indexed yet, 0 at the end */
+static int so_z_scan(struct so_zstream *z)
+{
+	unsigned char hdr[ZHDR_SIZE];
+	struct so_zblock *index;
+	ssize_t res;
+	int raw_len, size;
+
+	if (z->scan_done)
+		return 0;
+
+	res = pread(z->fd, hdr, ZHDR_SIZE, z->scan_off);
+	if (res == 0) {
+		z->scan_done = 1;
+		return 0;
+	}
+	if (res == -1)
+		return -1;
+
+	raw_len = so_z_get32(hdr + 4);
+	size = so_z_get32(hdr + 8);
+	if (res != ZHDR_SIZE || memcmp(hdr, "SZB", 3) != 0 ||
+	    hdr[3] > ZCODEC_LZ || raw_len <= 0 || raw_len > ZBLOCK_SIZE ||
+	    size <= 0 || size > ZBLOCK_SIZE ||
+	    (hdr[3] == ZCODEC_STORED && size != raw_len)) {
+		errno = EIO;
+		return -1;
+	}
+
+	if (z->nindex == z->index_cap) {
+		index = realloc(z->index, 2 * (z->index_cap + 32) *
+				sizeof(struct so_zblock));
+		if (index == NULL)
+			return -1;
+		z->index = index;
+		z->index_cap = 2 * (z->index_cap + 32);
+	}
+
+	z->index[z->nindex].off = z->scan_off;
+	z->index[z->nindex].raw = z->scan_raw;
+	z->nindex++;
+	z->scan_off += ZHDR_SIZE + size;
+	z->scan_raw += raw_len;
+
+	return 1;
+}
+
+/* make the i-th block the current one */
+static int so_z_load(struct so_zstream *z, int i)
+{
+	long end_off = i + 1 < z->nindex ? z->index[i + 1].off : z->scan_off;
+	long end_raw = i + 1 < z->nindex ? z->index[i + 1].raw : z->scan_raw;
+	unsigned char *hdr = (unsigned char *)z->packed;
+	int size = end_off - z->index[i].off;
+	int raw_len = end_raw - z->index[i].raw;
+
+	if (pread(z->fd, z->packed, size, z->index[i].off) != size)
+		goto corrupted;
+
+	if (hdr[3] == ZCODEC_STORED)
+		memcpy(z->raw, z->packed + ZHDR_SIZE, raw_len);
+	else if (so_lz_decompress(hdr + ZHDR_SIZE, size - ZHDR_SIZE,
+				  (unsigned char *)z->raw, raw_len) != raw_len)
+		goto corrupted;
+
+	z->cur = i;
+	z->raw_start = z->index[i].raw;
+	z->raw_len = raw_len;
+	z->raw_pos = 0;
+
+	return 0;
+
+corrupted:
+	z->raw_len = 0;
+	errno = EIO;
+	return -1;
+}
+
+static ssize_t so_z_read(void *cookie, char *buf, size_t size)
+{
+	struct so_zstream *z = cookie;
+	size_t done = 0;
+	int count, res;
+
+	while (done < size) {
+		/* go to the next block, indexing it when it is a new one */
+		if (z->raw_pos == z->raw_len) {
+			if (z->cur + 1 == z->nindex) {
+				res = so_z_scan(z);
+				if (res == 0)
+					break;
+				if (res == -1)
+					return done > 0 ? (ssize_t)done : -1;
+			}
+			if (so_z_load(z, z->cur + 1) == -1)
+				return done > 0 ? (ssize_t)done : -1;
+			continue;
+		}
+
+		count = z->raw_len - z->raw_pos;
+		if ((size_t)count > size - done)
+			count = size - done;
+		memcpy(buf + done, z->raw + z->raw_pos, count);
+		z->raw_pos += count;
+		done += count;
+	}
+
+	return done;
+}
+
+static ssize_t so_z_write(void *cookie, const char *buf, size_t size)
+{
+	struct so_zstream *z = cookie;
+	size_t done = 0;
+	int count;
+
+	while (done < size) {
+		count = ZBLOCK_SIZE - z->raw_len;
+		if ((size_t)count > size - done)
+			count = size - done;
+		memcpy(z->raw + z->raw_len, buf + done, count);
+		z->raw_len += count;
+		done += count;
+
+		if (z->raw_len == ZBLOCK_SIZE && so_z_push(z) == -1)
+			return -1;
+	}
+
+	return size;
+}
+
+/*
+ * reading streams seek to the block holding the offset, reading only the
+ * headers of the blocks not indexed yet; writing streams cannot move
+ */
+static int so_z_seek(void *cookie, long *offset, int whence)
+{
+	struct so_zstream *z = cookie;
+	long target = *offset;
+	int lo, hi, mid, res;
+
+	if (z->writing) {
+		if (whence == SEEK_SET && target == z->raw_start + z->raw_len)
+			return 0;
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (whence == SEEK_END) {
+		while ((res = so_z_scan(z)) == 1)
+			;
+		if (res == -1)
+			return -1;
+		target += z->scan_raw;
+	}
+
+	if (target < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (z->scan_raw <= target && (res = so_z_scan(z)) != 0) {
+		if (res == -1)
+			return -1;
+	}
+
+	if (target >= z->scan_raw) {
+		/* at or past the end, the next read finds no block */
+		z->cur = z->nindex - 1;
+		z->raw_start = target;
+		z->raw_len = 0;
+		z->raw_pos = 0;
+	} else {
+		/* the last block that starts at or before the offset */
+		lo = 0;
+		hi = z->nindex - 1;
+		while (lo < hi) {
+			mid = (lo + hi + 1) / 2;
+			if (z->index[mid].raw <= target)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+
+		if ((lo != z->cur || z->raw_len == 0) && so_z_load(z, lo) == -1)
+			return -1;
+		z->raw_pos = target - z->raw_start;
+	}
+
+	*offset = target;
+	return 0;
+}
+
+static void so_z_free(struct so_zstream *z)
+{
+	pthread_mutex_destroy(&z->lock);
+	pthread_cond_destroy(&z->cond);
+	free(z->raw);
+	free(z->pending);
+	free(z->packed);
+	free(z->index);
+	free(z);
+}
+
+static int so_z_close(void *cookie)
+{
+	struct so_zstream *z = cookie;
+	int res = 0;
+
+	if (z->writing && so_z_push(z) == -1)
+		res = -1;
+
+	if (z->threaded) {
+		pthread_mutex_lock(&z->lock);
+		z->stop = 1;
+		pthread_cond_broadcast(&z->cond);
+		pthread_mutex_unlock(&z->lock);
+		pthread_join(z->worker, NULL);
+		if (z->worker_error)
+			res = -1;
+	}
+
+	if (close(z->fd) == -1)
+		res = -1;
+	so_z_free(z);
+
+	return res;
+}
+
+/*
+ * turn a stream into a compressed one, whose I/O goes through the codec
+ * with the stream as the cookie of the callbacks
+ */
+static int so_z_init(SO_FILE *stream, int threaded)
+{
+	struct so_zstream *z = calloc(1, sizeof(struct so_zstream));
+
+	if (z == NULL)
+		return -1;
+
+	pthread_mutex_init(&z->lock, NULL);
+	pthread_cond_init(&z->cond, NULL);
+	z->fd = stream->fd;
+	z->writing = (stream->mode & O_ACCMODE) != O_RDONLY;
+	z->cur = -1;
+	z->raw = malloc(ZBLOCK_SIZE);
+	z->packed = malloc(ZHDR_SIZE + ZBLOCK_SIZE);
+	if (threaded)
+		z->pending = malloc(ZBLOCK_SIZE);
+	if (z->raw == NULL || z->packed == NULL ||
+	    (threaded && z->pending == NULL)) {
+		so_z_free(z);
+		return -1;
+	}
+
+	if (threaded) {
+		if (pthread_create(&z->worker, NULL, so_z_worker, z) != 0) {
+			so_z_free(z);
+			return -1;
+		}
+		z->threaded = 1;
+	}
+
+	stream->z = z;
+	stream->cookie_io = 1;
+	stream->cookie = z;
+	stream->io.read = so_z_read;
+	stream->io.write = so_z_write;
+	stream->io.seek = so_z_seek;
+	stream->io.close = so_z_close;
+
+	return 0;
+}
+
+/*
+ * CRC32C (Castagnoli, reflected polynomial 0x82f63b78); the helpers below
+ * work on the crc before the final inversion
+ */
+#define CRC32C_POLY 0x82f63b78
+/* bytes of each of the three lanes of the hardware version */
+#define CRC32C_LANE 1024
+
+static unsigned int so_crc32c_table[8][256];
+static pthread_once_t so_crc32c_once = PTHREAD_ONCE_INIT;
+static int so_crc32c_hw;
+/* x^(8 * CRC32C_LANE - 33) and x^(16 * CRC32C_LANE - 33) mod P */
+static unsigned long long so_crc32c_k1, so_crc32c_k2;
+
+/* x^n mod P, reflected */
+static unsigned int so_crc32c_xpow(long n)
+{
+	unsigned int v = 0x80000000;
+
+	for (; n > 0; n--)
+		v = (v >> 1) ^ (v & 1 ? CRC32C_POLY : 0);
+
+	return v;
+}
+
+static void so_crc32c_init(void)
+{
+	unsigned int crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		so_crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			so_crc32c_table[j][i] =
+				(so_crc32c_table[j - 1][i] >> 8) ^
+				so_crc32c_table[0][so_crc32c_table[j - 1][i] &
+						   0xff];
+
+	so_crc32c_k1 = so_crc32c_xpow(8 * CRC32C_LANE - 33);
+	so_crc32c_k2 = so_crc32c_xpow(16 * CRC32C_LANE - 33);
+
+#if defined(__x86_64__)
+	so_crc32c_hw = __builtin_cpu_supports("sse4.2") &&
+		       __builtin_cpu_supports("pclmul");
+#endif
+}
+
+/* slice-by-8: eight bytes per step through eight tables */
+static unsigned int so_crc32c_sw(unsigned int crc, const unsigned char *buf,
+				 size_t len)
+{
+	unsigned int lo, hi;
+
+	for (; len > 0 && ((unsigned long)buf & 7) != 0; len--)
+		crc = (crc >> 8) ^ so_crc32c_table[0][(crc ^ *buf++) & 0xff];
+
+	for (; len >= 8; len -= 8, buf += 8) {
+		lo = (buf[0] | buf[1] << 8 | buf[2] << 16 |
+		      (unsigned int)buf[3] << 24) ^ crc;
+		hi = buf[4] | buf[5] << 8 | buf[6] << 16 |
+		     (unsigned int)buf[7] << 24;
+		crc = so_crc32c_table[7][lo & 0xff] ^
+		      so_crc32c_table[6][(lo >> 8) & 0xff] ^
+		      so_crc32c_table[5][(lo >> 16) & 0xff] ^
+		      so_crc32c_table[4][lo >> 24] ^
+		      so_crc32c_table[3][hi & 0xff] ^
+		      so_crc32c_table[2][(hi >> 8) & 0xff] ^
+		      so_crc32c_table[1][(hi >> 16) & 0xff] ^
+		      so_crc32c_table[0][hi >> 24];
+	}
+
+	for (; len > 0; len--)
+		crc = (crc >> 8) ^ so_crc32c_table[0][(crc ^ *buf++) & 0xff];
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+/*
+ * the crc32 instruction has a latency of three cycles, so large buffers
+ * are processed as three independent lanes whose crcs are then moved
+ * over the lanes that follow them (a carry-less multiplication by
+ * x^(8 * bytes) mod P, reduced by one more crc32) and combined
+ */
+__attribute__((target("sse4.2,pclmul")))
+static unsigned long long so_crc32c_shift(unsigned long long crc,
+					  unsigned long long k)
+{
+	__m128i prod = _mm_clmulepi64_si128(_mm_cvtsi64_si128(crc),
+					    _mm_cvtsi64_si128(k), 0);
+
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(prod));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static unsigned int so_crc32c_sse(unsigned int crc, const unsigned char *buf,
+				  size_t len)
+{
+	unsigned long long a = crc, b, c, va, vb, vc;
+	int i;
+
+	for (; len > 0 && ((unsigned long)buf & 7) != 0; len--)
+		a = _mm_crc32_u8(a, *buf++);
+
+	for (; len >= 3 * CRC32C_LANE; len -= 3 * CRC32C_LANE) {
+		b = 0;
+		c = 0;
+		for (i = 0; i < CRC32C_LANE; i += 8) {
+			memcpy(&va, buf + i, 8);
+			memcpy(&vb, buf + CRC32C_LANE + i, 8);
+			memcpy(&vc, buf + 2 * CRC32C_LANE + i, 8);
+			a = _mm_crc32_u64(a, va);
+			b = _mm_crc32_u64(b, vb);
+			c = _mm_crc32_u64(c, vc);
+		}
+		a = so_crc32c_shift(a, so_crc32c_k2) ^
+		    so_crc32c_shift(b, so_crc32c_k1) ^ c;
+		buf += 3 * CRC32C_LANE;
+	}
+
+	for (; len >= 8; len -= 8, buf += 8) {
+		memcpy(&va, buf, 8);
+		a = _mm_crc32_u64(a, va);
+	}
+
+	for (; len > 0; len--)
+		a = _mm_crc32_u8(a, *buf++);
+
+	return a;
+}
+#endif
+
+/* the crc of buf following the one of the data before it (0 at first) */
+unsigned int so_crc32c(unsigned int crc, const void *buf, size_t len)
+{
+	pthread_once(&so_crc32c_once, so_crc32c_init);
+
+	crc = ~crc;
+#if defined(__x86_64__)
+	if (so_crc32c_hw)
+		return ~so_crc32c_sse(crc, buf, len);
+#endif
+	return ~so_crc32c_sw(crc, buf, len);
+}
+
+/*
+ * watch the file of a follow stream, and its directory for the new
+ * files created or moved at its path
+ */
+static int so_follow_init(SO_FILE *stream)
+{
+	char *dir = strdup(stream->pathname);
+	char *slash;
+
+	if (dir == NULL)
+		return -1;
+
+	slash = strrchr(dir, '/');
+	if (slash == NULL)
+		strcpy(dir, ".");
+	else if (slash == dir)
+		slash[1] = '\0';
+	else
+		*slash = '\0';
+
+	stream->follow_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (stream->follow_fd == -1) {
+		free(dir);
+		return -1;
+	}
+	stream->follow = 1;
+
+	stream->follow_wd = inotify_add_watch(stream->follow_fd,
+					      stream->pathname,
+					      FOLLOW_FILE_EVENTS);
+	if (stream->follow_wd == -1 ||
+	    inotify_add_watch(stream->follow_fd, dir,
+			      FOLLOW_DIR_EVENTS) == -1) {
+		free(dir);
+		return -1;
+	}
+
+	free(dir);
+	return 0;
+}
+
+/*
+ * open name in dirfd; the lookups that do not create or truncate first
+ * try openat2 with RESOLVE_CACHED, which completes only when the whole
+ * path is in the dentry cache, without taking any lock
+ */
+static int so_openat(int dirfd, const char *name, int flags)
+{
+	static int no_cached;
+	struct open_how how;
+	int fd;
+
+	if (!(flags & (O_CREAT | O_TRUNC)) &&
+	    !__atomic_load_n(&no_cached, __ATOMIC_RELAXED)) {
+		memset(&how, 0, sizeof(how));
+		how.flags = flags;
+		how.resolve = RESOLVE_CACHED;
+		fd = syscall(SYS_openat2, dirfd, name, &how, sizeof(how));
+		if (fd >= 0 || (errno != EAGAIN && errno != ENOSYS &&
+				errno != EINVAL))
+			return fd;
+
+		/* a kernel without openat2 or RESOLVE_CACHED */
+		if (errno != EAGAIN)
+			__atomic_store_n(&no_cached, 1, __ATOMIC_RELAXED);
+	}
+
+	return openat(dirfd, name, flags, 0644);
+}
+
+SO_FILE *so_fopen(const char *pathname, const char *mode)
+{
+	return so_fopenat(AT_FDCWD, pathname, mode);
+}
+
+SO_FILE *so_fopenat(int dirfd, const char *pathname, const char *mode)
+{
+	SO_FILE *file;
+	int mode_flags, options;
+
+	/* figure out which flags to be used for the open function */
+	if (so_parse_mode(mode, &mode_flags, &options) == -1)
+		return NULL;
+
+	/* follow streams reopen their path, so it has to stand on its own */
+	if ((options & SO_OPT_FOLLOW) && dirfd != AT_FDCWD &&
+	    pathname[0] != '/') {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (options & SO_OPT_DIRECT)
+		mode_flags |= O_DIRECT;
+	if (options & SO_OPT_SHARED)
+		mode_flags &= ~O_APPEND;
+	if (options & SO_OPT_NONBLOCK)
+		mode_flags |= O_NONBLOCK;
+
+	/* open the file */
+	int file_descriptor = dirfd == AT_FDCWD ?
+			      open(pathname, mode_flags, 0644) :
+			      so_openat(dirfd, pathname, mode_flags);
+
+	/* treat the error */
+	if (file_descriptor == -1)
+		return NULL;
+
+	file = so_alloc_file(file_descriptor, mode_flags, options);
+	if (file == NULL) {
+		close(file_descriptor);
+		return NULL;
+	}
+
+	/* plain read/write streams keep the buffer over direction changes */
+	if ((mode_flags & O_ACCMODE) == O_RDWR && !(mode_flags & O_APPEND) &&
+	    options == 0)
+		file->unified = 1;
+
+	if (options & SO_OPT_SHARED) {
+		if (so_shared_init(file, mode[0] == 'a') == -1) {
+			close(file_descriptor);
+			so_free_file(file);
+			return NULL;
+		}
+	}
+
+	file->pathname = malloc((strlen(pathname) + 1) * sizeof(char));
+	if (file->pathname == NULL) {
+		close(file_descriptor);
+		so_free_file(file);
+		return NULL;
+	}
+	strcpy(file->pathname, pathname);
+
+	if (options & SO_OPT_SPARSE) {
+		file->sparse = 1;
+		file->positional = 1;
+	}
+
+	if ((options & SO_OPT_FOLLOW) && so_follow_init(file) == -1) {
+		close(file_descriptor);
+		so_free_file(file);
+		return NULL;
+	}
+
+	if ((options & SO_OPT_COMPRESS) &&
+	    so_z_init(file, options & SO_OPT_THREAD) == -1) {
+		close(file_descriptor);
+		so_free_file(file);
+		return NULL;
+	}
+
+	return file;
+}
+
+int so_fclose(SO_FILE *stream)
+{
+	int res;
+	int res_ferror = 0;
+
+	/*
+	 * if the buffer cursor is not at its beginning and if
+	 * we are after a write process, then we should flush the
+	 * output once again
+	 */
+	if (stream->shared != NULL) {
+		if (so_shared_close(stream) == -1)
+			res_ferror = 1;
+	} else if (stream->unified) {
+		so_fflush(stream);
+		res_ferror = stream->error;
+	} else if (stream->buffer_position > 0 && stream->read_write == 1) {
+		/* the last flush of a non-blocking stream waits */
+		if (stream->nonblock)
+			fcntl(stream->fd, F_SETFL,
+			      fcntl(stream->fd, F_GETFL) & ~O_NONBLOCK);
+		stream->nonblock = 0;
+		so_fflush(stream);
+		res_ferror = stream->error;
+	}
+
+	if (stream->prealloc > 0)
+		so_prealloc_trim(stream);
+
+	/* close the file; the memory of memory streams is not ours */
+	if (stream->mem) {
+		res = 0;
+		if (!stream->mem_owned)
+			stream->buffer = NULL;
+	} else {
+		res = so_sys_close(stream);
+	}
+
+	/* free allocated memory */
+	so_free_file(stream);
+
+	if (res_ferror == 1)
+		return SO_EOF;
+
+	if (res == -1)
+		return SO_EOF;
+	return 0;
+}
+
+int so_fileno(SO_FILE *stream)
+{
+	/* return the file descriptor */
+	return stream->fd;
+}
+
+/*
+ * write the buffer out; drain also waits for the block a compressed
+ * stream is gathering, which the flushes of a full buffer leave to the
+ * worker so that its compression overlaps with the next writes
+ */
+static int so_flush_buffer(SO_FILE *stream, int drain)
+{
+	int res;
+	int stream_size = stream->buffer_position;
+	int current_cursor = 0;
+	int tail = 0;
+
+	/* a shared writer flushes the buffer of the calling thread */
+	if (stream->shared != NULL) {
+		struct so_wbuf *wbuf = pthread_getspecific(stream->shared->key);
+
+		if (wbuf != NULL && so_shared_flush(stream, wbuf) == -1)
+			return SO_EOF;
+		return 0;
+	}
+
+	/* read/write streams write the dirty range and keep the window */
+	if (stream->unified)
+		return so_flush_dirty(stream);
+
+	/* there is nothing to write after a read */
+	if (stream->read_write != 1)
+		return 0;
+
+	/* the tail kept by a direct stream was already written */
+	if (stream->direct && stream_size == stream->buffer_synced)
+		return 0;
+
+	/*
+	 * a direct stream writes the whole blocks with O_DIRECT and
+	 * the unaligned tail separately
+	 */
+	if (stream->direct) {
+		tail = stream_size % stream->align;
+		stream_size -= tail;
+	}
+
+	so_prealloc(stream, stream_size + tail);
+
+	/*
+	 *write the data that is currently in the buffer
+	 * use a while loop as the write call will not always
+	 * return a value equal to stream_size
+	 */
+	while (stream_size > 0) {
+		/* write to file */
+		if (stream->positional)
+			res = so_sys_pwrite(stream,
+					    stream->buffer + current_cursor,
+					    stream_size, stream->file_offset);
+		else
+			res = so_sys_write(stream,
+					   stream->buffer + current_cursor,
+					   stream_size);
+
+		/*
+		 * a non-blocking descriptor that cannot take more data
+		 * keeps the rest in the buffer, for the next flush
+		 */
+		if (res == -1 && so_would_block(stream)) {
+			memmove(stream->buffer, stream->buffer + current_cursor,
+				stream->buffer_position - current_cursor);
+			stream->buffer_position -= current_cursor;
+			stream->curr_buff_size = 0;
+			return SO_EOF;
+		}
+
+		/* treat error */
+		if (res == -1) {
+			stream->error = 1;
+			return SO_EOF;
+		}
+
+		/* set the new cursors and the new buffer size */
+		current_cursor += res;
+		stream_size -= res;
+		stream->file_offset += res;
+	}
+
+	/* a compressed stream also writes the block it was gathering */
+	if (drain && stream->z != NULL && so_z_flush(stream->z) == -1) {
+		stream->error = 1;
+		return SO_EOF;
+	}
+
+	if (tail > 0) {
+		if (so_write_tail(stream, stream->buffer + current_cursor,
+				  tail, stream->file_offset) == -1) {
+			stream->error = 1;
+			return SO_EOF;
+		}
+
+		/*
+		 * keep the tail as the beginning of the next block so the
+		 * following writes stay aligned; in append mode the kernel
+		 * picks the offset, so there is nothing to keep
+		 */
+		if (stream->mode & O_APPEND) {
+			stream->file_offset += tail;
+			tail = 0;
+		} else {
+			memmove(stream->buffer, stream->buffer + current_cursor,
+				tail);
+		}
+	}
+
+	/* reinitialize the buffer */
+	stream->buffer_position = tail;
+	stream->buffer_synced = tail;
+	stream->curr_buff_size = 0;
+
+	return 0;
+}
+
+int so_fflush(SO_FILE *stream)
+{
+	return so_flush_buffer(stream, 1);
+}
+
+/*
+ * positional streams never move the cursor of the file descriptor,
+ * which may be shared, so they only compute the new offset
+ */
+static long so_seek_positional(SO_FILE *stream, long offset, int whence)
+{
+	struct stat st;
+
+	if (whence == SEEK_END) {
+		if (stream->limit >= 0) {
+			offset += stream->limit;
+		} else {
+			if (fstat(stream->fd, &st) == -1)
+				return -1;
+			offset += st.st_size;
+		}
+	}
+
+	if (offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return offset;
+}
+
+int so_fseek(SO_FILE *stream, long offset, int whence)
+{
+	long res;
+
+	/* shared writers do not have a cursor */
+	if (stream->shared != NULL)
+		return -1;
+
+	if (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/*
+	 * the cursor of the file descriptor is ahead of the logical
+	 * one when we have data buffered
+	 */
+	if (whence == SEEK_CUR) {
+		offset += stream->cursor;
+		whence = SEEK_SET;
+	}
+
+	if (stream->mem)
+		return so_mem_seek(stream, offset, whence);
+
+	/* read/write streams move inside their window without any syscall */
+	if (stream->unified && whence == SEEK_SET &&
+	    offset >= stream->cursor - stream->buffer_position &&
+	    offset <= stream->cursor - stream->buffer_position +
+		      stream->curr_buff_size) {
+		stream->buffer_position += offset - stream->cursor;
+		stream->cursor = offset;
+		stream->eof = 0;
+		return 0;
+	}
+
+	/*
+	 * if the previous read-write operation was a write
+	 * then we need to fluch the buffer once again
+	 */
+	if (stream->read_write == 1 || stream->unified) {
+		if (stream->buffer_position > 0 || stream->unified)
+			so_fflush(stream);
+	}
+
+	/* call lseek to move the actual cursor in the file */
+	if (stream->positional)
+		res = so_seek_positional(stream, offset, whence);
+	else
+		res = so_sys_lseek(stream, offset, whence);
+
+	/* a failed seek leaves the buffer and the cursors as they were */
+	if (res == -1)
+		return -1;
+	/* update the cursor field and reset the buffer fields */
+	stream->read_write = -1;
+	stream->cursor = res;
+	stream->file_offset = res;
+	stream->buffer_position = 0;
+	stream->buffer_synced = 0;
+	stream->curr_buff_size = 0;
+	stream->eof = 0;
+
+	/* direct streams keep the cursor of the descriptor aligned */
+	if (stream->positional) {
+		stream->file_offset = res - res % stream->align;
+	} else if (stream->direct && res % stream->align != 0) {
+		res = so_sys_lseek(stream, res - res % stream->align,
+				   SEEK_SET);
+		if (res != -1)
+			stream->file_offset = res;
+	}
+
+	return 0;
+}
+
+long so_ftell(SO_FILE *stream)
+{
+	/* a shared writer reports the end of the data reserved so far */
+	if (stream->shared != NULL)
+		return __atomic_load_n(&stream->shared->offset,
+				       __ATOMIC_RELAXED);
+
+	/* return the current cursor */
+	return stream->cursor;
+}
+
+/* done gets the number of bytes copied to ptr, whole members or not */
+static size_t so_read_members(void *ptr, size_t size, size_t nmemb,
+			       SO_FILE *stream, size_t *done)
+{
+	size_t bytes_to_read;
+	size_t cursor_ptr = 0;
+	int bytes_unread_buffer;
+	int count;
+
+	*done = 0;
+
+	/*
+	 * if read is called after a write, then we have
+	 * to reset the buffer
+	 */
+	if (so_switch_mode(stream, 0) == -1)
+		return 0;
+
+	/* total bytes that need to be returned */
+	bytes_to_read = size * nmemb;
+
+	/* read inside a while loop until we read all the bytes that we needed */
+	while (bytes_to_read > 0) {
+		bytes_unread_buffer = stream->curr_buff_size - stream->buffer_position;
+
+		/* read more bytes when the buffer was consumed */
+		if (bytes_unread_buffer == 0) {
+			count = so_refill(stream);
+
+			/*
+			 * a non-blocking stream without data gives the bytes of
+			 * an incomplete member back to the buffer (they are its
+			 * last ones, the failed refill kept it as it was)
+			 */
+			if (count < 0 && !stream->error &&
+			    cursor_ptr % size <= (size_t)stream->buffer_position) {
+				stream->buffer_position -= cursor_ptr % size;
+				stream->cursor -= cursor_ptr % size;
+				*done -= cursor_ptr % size;
+			}
+
+			/* stop on errors or at the end of the file */
+			if (count <= 0)
+				return cursor_ptr / size;
+			continue;
+		}
+
+		/*
+		 * copy either the bytes left to read or the bytes left in
+		 * the buffer, whichever is smaller
+		 */
+		if ((size_t)bytes_unread_buffer > bytes_to_read)
+			bytes_unread_buffer = bytes_to_read;
+
+		so_copy((char *)ptr + cursor_ptr,
+			stream->buffer + stream->buffer_position,
+			bytes_unread_buffer);
+		stream->buffer_position += bytes_unread_buffer;
+		stream->cursor += bytes_unread_buffer;
+		bytes_to_read -= bytes_unread_buffer;
+		cursor_ptr += bytes_unread_buffer;
+		*done = cursor_ptr;
+	}
+	return nmemb;
+}
+
+/* done gets the number of bytes taken from ptr, whole members or not */
+static size_t so_write_members(const void *ptr, size_t size, size_t nmemb,
+			       SO_FILE *stream, size_t *done)
+{
+	int bytes_free;
+	size_t bytes_to_write = size * nmemb;
+	size_t ptr_cursor = 0;
+
+	*done = 0;
+	if (stream->shared != NULL) {
+		nmemb = so_shared_fwrite(ptr, size, nmemb, stream);
+		*done = nmemb * size;
+		return nmemb;
+	}
+	if (stream->unified)
+		return so_unified_fwrite(ptr, size, nmemb, stream, done);
+
+	/*
+	 * if we had a read operation before
+	 * then we should reset the buffer
+	 */
+	if (so_switch_mode(stream, 1) == -1)
+		return 0;
+
+	/* a direct stream writing in the middle of a block */
+	if (bytes_to_write > 0 && so_head_skip(stream))
+		so_load_head(stream);
+
+	/* write to buffer while we have bytes to write */
+	while (bytes_to_write > 0) {
+		/* the number of bytes that can be written */
+		bytes_free = stream->buffer_size - stream->buffer_position;
+		if ((size_t)bytes_free > bytes_to_write)
+			bytes_free = bytes_to_write;
+
+		so_copy(stream->buffer + stream->buffer_position,
+			(const char *)ptr + ptr_cursor, bytes_free);
+		stream->buffer_position += bytes_free;
+		stream->cursor += bytes_free;
+		ptr_cursor += bytes_free;
+		bytes_to_write -= bytes_free;
+		*done = ptr_cursor;
+
+		/* flush the buffer once it is full */
+		if (stream->buffer_position == stream->buffer_size &&
+		    so_flush_buffer(stream, 0) == SO_EOF) {
+			/* a non-blocking descriptor took part of the buffer */
+			if (!stream->error &&
+			    stream->buffer_position < stream->buffer_size)
+				continue;
+
+			/*
+			 * a non-blocking descriptor took nothing, so the bytes
+			 * of an incomplete member (the last ones copied) are
+			 * taken back from the buffer
+			 */
+			if (!stream->error &&
+			    ptr_cursor % size <= (size_t)bytes_free) {
+				stream->buffer_position -= ptr_cursor % size;
+				stream->cursor -= ptr_cursor % size;
+				ptr_cursor -= ptr_cursor % size;
+				*done = ptr_cursor;
+			}
+			return ptr_cursor / size;
+		}
+	}
+	return nmemb;
+}
+
+/* the checksum covers the bytes copied, whole members or not */
+size_t so_fread(void *ptr, size_t size, size_t nmemb, SO_FILE *stream)
+{
+	size_t done;
+	size_t res = so_read_members(ptr, size, nmemb, stream, &done);
+
+	if (stream->crc_on)
+		stream->crc = so_crc32c(stream->crc, ptr, done);
+
+	return res;
+}
+
+size_t so_fwrite(const void *ptr, size_t size, size_t nmemb, SO_FILE *stream)
+{
+	size_t done;
+	size_t res = so_write_members(ptr, size, nmemb, stream, &done);
+
+	if (stream->crc_on)
+		stream->crc = so_crc32c(stream->crc, ptr, done);
+
+	return res;
+}
+
+int so_fgetc(SO_FILE *stream)
+{
+	unsigned char res;
+
+	if (so_switch_mode(stream, 0) == -1)
+		return SO_EOF;
+
+	/* if the buffer is empty or if it is filled, then we should read more */
+	if (stream->buffer_position == stream->curr_buff_size) {
+		if (so_refill(stream) <= 0)
+			return SO_EOF;
+	}
+
+	/* return the last byte */
+	res = (unsigned char) stream->buffer[stream->buffer_position++];
+	stream->cursor++;
+
+	if (stream->crc_on)
+		stream->crc = so_crc32c(stream->crc, &res, 1);
+
+	return (int) res;
+}
+
+int so_ungetc(int c, SO_FILE *stream)
+{
+	int gap;
+
+	/* a running checksum cannot take the byte back */
+	if (c == SO_EOF || stream->crc_on || so_switch_mode(stream, 0) == -1)
+		return SO_EOF;
+
+	/*
+	 * the memory of memory streams and the window of read/write streams
+	 * are the data itself, so they only move back over the same byte
+	 */
+	if (stream->mem || stream->unified) {
+		if (stream->buffer_position == 0 ||
+		    stream->buffer[stream->buffer_position - 1] != (char)c)
+			return SO_EOF;
+	} else if (stream->buffer_position == 0) {
+		/*
+		 * make room in front of the bytes not read yet, which have
+		 * to end where the descriptor is (not so for a direct stream
+		 * that moved into the middle of a block)
+		 */
+		gap = stream->buffer_size - stream->curr_buff_size;
+		if (gap == 0 || stream->cursor + stream->curr_buff_size !=
+				stream->file_offset)
+			return SO_EOF;
+
+		memmove(stream->buffer + gap, stream->buffer,
+			stream->curr_buff_size);
+		stream->buffer_position = gap;
+		stream->curr_buff_size = stream->buffer_size;
+	}
+
+	stream->buffer_position--;
+	stream->cursor--;
+	if (!stream->mem && !stream->unified)
+		stream->buffer[stream->buffer_position] = c;
+	stream->eof = 0;
+
+	return (unsigned char)c;
+}
+
+char *so_fpeek(SO_FILE *stream, size_t n, size_t *avail)
+{
+	size_t have;
+	int count = 1;
+
+	if (avail != NULL)
+		*avail = 0;
+
+	if (stream->shared != NULL || so_switch_mode(stream, 0) == -1)
+		return NULL;
+
+	/* the bytes have to fit in the buffer, after the block of the cursor */
+	if (n > (size_t)(stream->buffer_size -
+			 stream->buffer_position % stream->align)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	have = stream->curr_buff_size - stream->buffer_position;
+	while (have < n && count > 0) {
+		count = so_refill(stream);
+		have = stream->curr_buff_size - stream->buffer_position;
+	}
+
+	if (avail != NULL)
+		*avail = have;
+
+	return have >= n ? stream->buffer + stream->buffer_position : NULL;
+}
+
+size_t so_fbuffered(SO_FILE *stream, int writing)
+{
+	/* turning the stream around takes a flush or a seek */
+	if (stream->shared != NULL ||
+	    (!stream->unified && stream->read_write == !writing))
+		return 0;
+
+	if (!writing)
+		return stream->curr_buff_size - stream->buffer_position;
+
+	/*
+	 * nothing goes to read only memory, and the head of a direct block
+	 * would be read when the data is stored
+	 */
+	if ((stream->mem && (stream->mode & O_ACCMODE) == O_RDONLY) ||
+	    so_head_skip(stream))
+		return 0;
+
+	return stream->buffer_size - stream->buffer_position;
+}
+
+void *so_freadrecs(SO_FILE *stream, size_t size, size_t max, size_t *count)
+{
+	size_t have;
+	char *recs;
+
+	*count = 0;
+	if (size == 0 || max == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* a record split by the end of the buffer is completed first */
+	recs = so_fpeek(stream, size, &have);
+	if (recs == NULL)
+		return NULL;
+
+	*count = have / size < max ? have / size : max;
+	stream->buffer_position += *count * size;
+	stream->cursor += *count * size;
+
+	if (stream->crc_on)
+		stream->crc = so_crc32c(stream->crc, recs, *count * size);
+
+	return recs;
+}
+
+void *so_freserverecs(SO_FILE *stream, size_t size, size_t max,
+		      size_t *count)
+{
+	size_t room;
+	int skip;
+
+	*count = 0;
+	if (size == 0 || max == 0 || size > (size_t)stream->buffer_size ||
+	    stream->shared != NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (stream->mem && (stream->mode & O_ACCMODE) == O_RDONLY) {
+		stream->error = 1;
+		return NULL;
+	}
+
+	if (so_switch_mode(stream, 1) == -1)
+		return NULL;
+
+	/*
+	 * a direct stream writing in the middle of a block: the records go
+	 * after the head, which so_fcommitrecs loads once they are stored
+	 */
+	skip = so_head_skip(stream);
+
+	/* make room for one record at least */
+	room = stream->buffer_size - stream->buffer_position - skip;
+	if (room < size && stream->mem) {
+		if (so_mem_grow(stream, stream->buffer_position +
+				size * max) == -1)
+			return NULL;
+	} else if (room < size && stream->unified) {
+		if (so_flush_dirty(stream) == SO_EOF)
+			return NULL;
+		stream->buffer_position = 0;
+		stream->curr_buff_size = 0;
+	} else if (room < size && so_flush_buffer(stream, 0) == SO_EOF) {
+		/* a non-blocking descriptor may have taken enough of it */
+		room = stream->buffer_size - stream->buffer_position;
+		if (room < size)
+			return NULL;
+	}
+
+	skip = so_head_skip(stream);
+	room = stream->buffer_size - stream->buffer_position - skip;
+	*count = room / size < max ? room / size : max;
+
+	return stream->buffer + stream->buffer_position + skip;
+}
+
+int so_fcommitrecs(SO_FILE *stream, size_t size, size_t count)
+{
+	int skip = so_head_skip(stream);
+	int start;
+	int len = size * count;
+
+	if (len == 0)
+		return 0;
+
+	if (skip) {
+		so_load_head(stream);
+		/* the head could not be read, the records start the buffer */
+		if (stream->buffer_position == 0)
+			memmove(stream->buffer, stream->buffer + skip, len);
+	}
+	start = stream->buffer_position;
+
+	if (stream->crc_on)
+		stream->crc = so_crc32c(stream->crc, stream->buffer + start,
+					len);
+
+	stream->buffer_position += len;
+	stream->cursor += len;
+
+	/* the same bookkeeping as so_fwrite, for the bytes now in place */
+	if (stream->unified) {
+		if (stream->dirty_start == stream->dirty_end ||
+		    start < stream->dirty_start)
+			stream->dirty_start = start;
+		if (stream->buffer_position > stream->dirty_end)
+			stream->dirty_end = stream->buffer_position;
+		if (stream->buffer_position > stream->curr_buff_size)
+			stream->curr_buff_size = stream->buffer_position;
+
+		if (stream->buffer_position == stream->buffer_size &&
+		    !stream->mem) {
+			if (so_flush_dirty(stream) == SO_EOF)
+				return SO_EOF;
+			stream->buffer_position = 0;
+			stream->curr_buff_size = 0;
+		}
+		return 0;
+	}
+
+	if (stream->buffer_position == stream->buffer_size &&
+	    so_flush_buffer(stream, 0) == SO_EOF && stream->error)
+		return SO_EOF;
+
+	return 0;
+}
+
+int so_fputc(int c, SO_FILE *stream)
+{
+	unsigned char byte = c;
+
+	if (so_fwrite(&byte, 1, 1, stream) != 1)
+		return SO_EOF;
+
+	return c;
+}
+
+int so_feof(SO_FILE *stream)
+{
+	/* the flag is set by the reads that get to the end of the file */
+	return stream->eof;
+}
+
+int so_ferror(SO_FILE *stream)
 {
 	/* return error status */
 	return stream->error;
 }
 
-SO_FILE *so_popen(const char *command, const char *type)
+SO_FILE *so_popen(const char *command, const char *type)
+{
+	int pid, arguments_size = 3;
+	SO_FILE *stream;
+	char **arguments;
+	int res, file_desc[2];
+	int res_exec;
+
+	if (strcmp(type, "r") != 0 && strcmp(type, "w") != 0)
+		return NULL;
+
+	/* create pipe */
+	res = pipe(file_desc);
+
+	if (res == -1)
+		return NULL;
+
+	/* set file desciptor based on the type given */
+	if (strcmp(type, "r") == 0)
+		stream = so_alloc_file(file_desc[0], O_RDONLY, 0);
+	else
+		stream = so_alloc_file(file_desc[1], O_WRONLY, 0);
+
+	if (stream == NULL) {
+		close(file_desc[0]);
+		close(file_desc[1]);
+		return NULL;
+	}
+
+	/* initialize arguments */
+	arguments = malloc(4 * sizeof(char *));
+	arguments[0] = malloc(3 * sizeof(char));
+	strcpy(arguments[0], "sh");
+	arguments[0][2] = '\0';
+	arguments[1] = malloc(3 * sizeof(char));
+	strcpy(arguments[1], "-c");
+	arguments[1][2] = '\0';
+	arguments[2] = malloc((strlen(command) + 1) * sizeof(char));
+	strcpy(arguments[2], command);
+	arguments[2][strlen(command)] = '\0';
+	arguments[3] = NULL;
+
+	/* create child process */
+	pid = fork();
+
+	/* if we had an error then we should treat it */
+	if (pid < 0) {
+		close(file_desc[0]);
+		close(file_desc[1]);
+		for (int i = 0; i < arguments_size; i++) {
+			if (arguments[i])
+				free(arguments[i]);
+		}
+		free(arguments);
+		so_free_file(stream);
+		return NULL;
+	}
+
+	/* if pid is 0 then we are in the child */
+	if (pid == 0) {
+		/*
+		 * based on the type, close the not necessary channels
+		 * and create a link to either stdin or stdout
+		 */
+		if (strcmp(type, "r") == 0) {
+			close(file_desc[0]);
+			dup2(file_desc[1], STDOUT_FILENO);
+		} else if (strcmp(type, "w") == 0) {
+			close(file_desc[1]);
+			dup2(file_desc[0], STDIN_FILENO);
+		}
+
+		/* execute the command */
+		res_exec = execv("/bin/sh", arguments);
+		if (res_exec)
+			return NULL;
+	} else {
+		/* in the parent set the pid */
+		stream->pid = pid;
+		/* close the not necessary channels */
+		if (strcmp(type, "r") == 0)
+			close(file_desc[1]);
+		else if (strcmp(type, "w") == 0)
+			close(file_desc[0]);
+	}
+
+	/* free allocated memory */
+	for (int i = 0; i < arguments_size; i++) {
+		if (arguments[i])
+			free(arguments[i]);
+	}
+	free(arguments);
+
+	return stream;
+}
+
+int so_pclose(SO_FILE *stream)
+{
+	int res = -1, status;
+	int pid = stream->pid;
+
+	/*
+	 * if there was a write operation, then we should flush
+	 * the buffer before closing the pipe
+	 */
+	if (stream->buffer_position > 0 && stream->read_write == 1)
+		so_fflush(stream);
+
+	/*
+	 * close the file and free the memory; the pipe is closed
+	 * first so that a child reading from it gets to its end
+	 */
+	close(stream->fd);
+	so_free_file(stream);
+
+	/* wait for the process */
+	if (pid != -1)
+		res = waitpid(pid, &status, 0);
+
+	if (res >= 0)
+		return 0;
+
+	return -1;
+}
+
+/* allocate a buffer for a block of the positional read cache */
+static char *so_pcache_alloc(SO_FILE *stream)
+{
+	void *data;
+
+	if (posix_memalign(&data, stream->direct ? stream->align : 64,
+			   PCACHE_BLOCK_SIZE))
+		return NULL;
+
+	return data;
+}
+
+/* the cache slot holding the block at offset, NULL if it is not cached */
+static struct so_pcache_block *so_pcache_find(struct so_pcache *pcache,
+					      long offset)
+{
+	int i;
+
+	for (i = 0; i < PCACHE_BLOCKS; i++) {
+		if (pcache->blocks[i].offset == offset)
+			return &pcache->blocks[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * copy from the cached block at block_offset to buf;
+ * returns the number of bytes copied or -1 if the block is not cached
+ */
+static int so_pcache_read(SO_FILE *stream, char *buf, size_t count,
+			  long offset, long block_offset)
+{
+	struct so_pcache_block *block;
+	int res = -1;
+
+	pthread_mutex_lock(&stream->pcache_lock);
+
+	if (stream->pcache == NULL) {
+		stream->pcache = calloc(1, sizeof(struct so_pcache));
+		if (stream->pcache != NULL) {
+			for (int i = 0; i < PCACHE_BLOCKS; i++)
+				stream->pcache->blocks[i].offset = -1;
+		}
+	}
+
+	block = stream->pcache ? so_pcache_find(stream->pcache, block_offset)
+			       : NULL;
+	if (block != NULL) {
+		res = block->size - (offset - block_offset);
+		if (res < 0)
+			res = 0;
+		if ((size_t)res > count)
+			res = count;
+		memcpy(buf, block->data + (offset - block_offset), res);
+		block->stamp = ++stream->pcache->clock;
+	}
+
+	pthread_mutex_unlock(&stream->pcache_lock);
+
+	return res;
+}
+
+/*
+ * put a block read by the caller in the cache, in place of the least
+ * recently used one; returns the buffer the caller has to free
+ */
+static char *so_pcache_insert(SO_FILE *stream, char *data, int size,
+			      long block_offset)
+{
+	struct so_pcache_block *block, *victim;
+	char *old;
+	int i;
+
+	pthread_mutex_lock(&stream->pcache_lock);
+
+	if (stream->pcache == NULL) {
+		pthread_mutex_unlock(&stream->pcache_lock);
+		return data;
+	}
+
+	/*
+	 * another thread may have read the same block meanwhile; free
+	 * slots were never used, so they are the least recently used
+	 */
+	victim = so_pcache_find(stream->pcache, block_offset);
+	if (victim == NULL) {
+		victim = &stream->pcache->blocks[0];
+		for (i = 1; i < PCACHE_BLOCKS; i++) {
+			block = &stream->pcache->blocks[i];
+			if (block->stamp < victim->stamp)
+				victim = block;
+		}
+	}
+
+	old = victim->data;
+	victim->data = data;
+	victim->offset = block_offset;
+	victim->size = size;
+	victim->stamp = ++stream->pcache->clock;
+
+	pthread_mutex_unlock(&stream->pcache_lock);
+
+	return old;
+}
+
+size_t so_pread(SO_FILE *stream, void *ptr, size_t count, long offset)
+{
+	char *buf = ptr;
+	char *data;
+	size_t done = 0;
+	long block_offset;
+	ssize_t res;
+	int copied;
+
+	while (done < count) {
+		block_offset = offset - offset % PCACHE_BLOCK_SIZE;
+
+		/* served from the cache */
+		copied = so_pcache_read(stream, buf + done, count - done,
+					offset, block_offset);
+		if (copied == 0)
+			break;
+		if (copied > 0) {
+			done += copied;
+			offset += copied;
+			continue;
+		}
+
+		/*
+		 * whole blocks are read straight in the buffer of the
+		 * caller, there is no point in caching them
+		 */
+		if (!stream->direct && offset == block_offset &&
+		    count - done >= PCACHE_BLOCK_SIZE) {
+			res = so_sys_pread(stream, buf + done,
+					   (count - done) - (count - done) %
+					   PCACHE_BLOCK_SIZE, offset);
+			if (res < 0) {
+				stream->error = 1;
+				break;
+			}
+			if (res == 0)
+				break;
+			done += res;
+			offset += res;
+			continue;
+		}
+
+		/* read the block outside the lock, then publish it */
+		data = so_pcache_alloc(stream);
+		if (data == NULL) {
+			stream->error = 1;
+			break;
+		}
+
+		res = so_sys_pread(stream, data, PCACHE_BLOCK_SIZE,
+				   block_offset);
+		if (res < 0) {
+			free(data);
+			stream->error = 1;
+			break;
+		}
+
+		copied = res - (offset - block_offset);
+		if (copied < 0)
+			copied = 0;
+		if ((size_t)copied > count - done)
+			copied = count - done;
+		memcpy(buf + done, data + (offset - block_offset), copied);
+
+		free(so_pcache_insert(stream, data, res, block_offset));
+
+		if (copied == 0)
+			break;
+		done += copied;
+		offset += copied;
+	}
+
+	return done;
+}
+
+size_t so_pwrite(SO_FILE *stream, const void *ptr, size_t count, long offset)
+{
+	const char *buf = ptr;
+	size_t done = 0;
+	ssize_t res;
+
+	while (done < count) {
+		res = so_sys_pwrite(stream, buf + done, count - done,
+				    offset + done);
+		if (res <= 0) {
+			stream->error = 1;
+			break;
+		}
+		done += res;
+	}
+
+	return done;
+}
+
+/* the work shared by the threads of so_fscan_chunks */
+struct so_scan {
+	SO_FILE *stream;
+	/* chunk i is [bounds[i], bounds[i + 1]) */
+	long *bounds;
+	int nchunks;
+	so_chunk_func func;
+	void *arg;
+	/* the next chunk to be processed */
+	int next;
+	/* the first error reported */
+	int result;
+};
+
+/*
+ * the offset right after the first delim found at or after offset - 1,
+ * the size of the file if there is none
+ */
+static long so_scan_align(SO_FILE *stream, char *buf, long offset, int delim,
+			  long size)
+{
+	ssize_t res;
+	char *p;
+
+	if (offset == 0 || offset >= size)
+		return offset;
+
+	offset--;
+	while (offset < size) {
+		res = so_sys_pread(stream, buf, BUF_SIZE, offset);
+		if (res <= 0)
+			return size;
+
+		p = memchr(buf, delim, res);
+		if (p != NULL)
+			return offset + (p - buf) + 1;
+		offset += res;
+	}
+
+	return size;
+}
+
+static void *so_scan_worker(void *arg)
+{
+	struct so_scan *scan = arg;
+	SO_FILE *chunk;
+	int i, res;
+	int zero = 0;
+
+	while (1) {
+		i = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED);
+		if (i >= scan->nchunks)
+			break;
+
+		/*
+		 * each chunk is a read only stream with its own buffer,
+		 * reading with pread from the shared file descriptor
+		 */
+		chunk = so_alloc_file(scan->stream->fd, O_RDONLY,
+				      scan->stream->direct ? SO_OPT_DIRECT : 0);
+		if (chunk == NULL) {
+			res = -1;
+		} else {
+			chunk->positional = 1;
+			chunk->read_write = 0;
+			chunk->cursor = scan->bounds[i];
+			chunk->file_offset = chunk->cursor -
+					     chunk->cursor % chunk->align;
+			chunk->limit = scan->bounds[i + 1];
+
+			res = scan->func(chunk, i, scan->arg);
+			so_free_file(chunk);
+		}
+
+		/* keep the first error */
+		if (res != 0)
+			__atomic_compare_exchange_n(&scan->result, &zero, res,
+						    0, __ATOMIC_RELAXED,
+						    __ATOMIC_RELAXED);
+		zero = 0;
+	}
+
+	return NULL;
+}
+
+int so_fscan_chunks(SO_FILE *stream, int nchunks, int delim,
+		    so_chunk_func func, void *arg, int nthreads)
+{
+	struct so_scan scan;
+	pthread_t *threads;
+	struct stat st;
+	char *buf;
+	int i, started;
+
+	if (nchunks <= 0 || so_fflush(stream) == SO_EOF ||
+	    fstat(stream->fd, &st) == -1)
+		return -1;
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+	if (nthreads > nchunks)
+		nthreads = nchunks;
+
+	scan.bounds = malloc((nchunks + 1) * sizeof(long));
+	threads = malloc(nthreads * sizeof(pthread_t));
+	buf = malloc(BUF_SIZE);
+	if (scan.bounds == NULL || threads == NULL || buf == NULL) {
+		free(scan.bounds);
+		free(threads);
+		free(buf);
+		return -1;
+	}
+
+	/* split the file in equal ranges, moved after the next delimiter */
+	for (i = 0; i <= nchunks; i++) {
+		scan.bounds[i] = st.st_size / nchunks * i +
+				 st.st_size % nchunks * i / nchunks;
+		if (delim != SO_EOF)
+			scan.bounds[i] = so_scan_align(stream, buf,
+						       scan.bounds[i],
+						       (unsigned char)delim,
+						       st.st_size);
+		if (i > 0 && scan.bounds[i] < scan.bounds[i - 1])
+			scan.bounds[i] = scan.bounds[i - 1];
+	}
+	free(buf);
+
+	scan.stream = stream;
+	scan.nchunks = nchunks;
+	scan.func = func;
+	scan.arg = arg;
+	scan.next = 0;
+	scan.result = 0;
+
+	/* the calling thread works as well if a thread cannot be created */
+	for (started = 0; started < nthreads; started++) {
+		if (pthread_create(&threads[started], NULL, so_scan_worker,
+				   &scan) != 0)
+			break;
+	}
+	if (started == 0)
+		so_scan_worker(&scan);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	free(scan.bounds);
+
+	return scan.result;
+}
+
+SO_FILE *so_fdopen(int fd, const char *mode)
+{
+	SO_FILE *file;
+	int mode_flags, options, fd_flags;
+	long offset;
+
+	if (so_parse_mode(mode, &mode_flags, &options) == -1)
+		return NULL;
+
+	/* compressed, hole-aware and follow streams need so_fopen */
+	if (options & (SO_OPT_COMPRESS | SO_OPT_SPARSE | SO_OPT_FOLLOW)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* the descriptor has to be open with a compatible access mode */
+	fd_flags = fcntl(fd, F_GETFL);
+	if (fd_flags == -1)
+		return NULL;
+	if ((fd_flags & O_ACCMODE) != O_RDWR &&
+	    (fd_flags & O_ACCMODE) != (mode_flags & O_ACCMODE)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* the modifiers that map to status flags are set on the descriptor */
+	if (options & SO_OPT_DIRECT)
+		fd_flags |= O_DIRECT;
+	if (options & SO_OPT_NONBLOCK)
+		fd_flags |= O_NONBLOCK;
+	if ((mode_flags & O_APPEND) && !(options & SO_OPT_SHARED))
+		fd_flags |= O_APPEND;
+	if (fcntl(fd, F_SETFL, fd_flags) == -1)
+		return NULL;
+
+	file = so_alloc_file(fd, mode_flags, options);
+	if (file == NULL)
+		return NULL;
+
+	if ((options & SO_OPT_SHARED) &&
+	    so_shared_init(file, mode[0] == 'a') == -1) {
+		so_free_file(file);
+		return NULL;
+	}
+
+	/* pipes and sockets have no offset, the stream starts at 0 */
+	offset = lseek(fd, 0, SEEK_CUR);
+	if (offset >= 0 && (mode_flags & O_ACCMODE) == O_RDWR &&
+	    !(mode_flags & O_APPEND) && options == 0)
+		file->unified = 1;
+	if (offset > 0) {
+		file->cursor = offset;
+		file->file_offset = offset;
+		if (file->direct && offset % file->align != 0 &&
+		    lseek(fd, offset - offset % file->align, SEEK_SET) != -1)
+			file->file_offset = offset - offset % file->align;
+	}
+
+	return file;
+}
+
+int so_fpoll(SO_FILE *stream)
+{
+	int events = 0;
+
+	/* buffered output waits for the descriptor to become writable */
+	if (stream->read_write == 1 && stream->buffer_position > 0)
+		events |= SO_POLLOUT;
+
+	/* input is needed only once the buffered one was consumed */
+	if ((stream->mode & O_ACCMODE) != O_WRONLY && stream->shared == NULL &&
+	    (stream->read_write != 0 ||
+	     stream->buffer_position == stream->curr_buff_size))
+		events |= SO_POLLIN;
+
+	return events;
+}
+
+/* a stream without descriptor whose buffer is the memory it works on */
+static SO_FILE *so_mem_alloc(int mode_flags)
+{
+	SO_FILE *file = calloc(1, sizeof(SO_FILE));
+
+	if (file == NULL)
+		return NULL;
+
+	so_init_file(file, -1, mode_flags, 0);
+	file->unified = 1;
+	file->mem = 1;
+
+	return file;
+}
+
+SO_FILE *so_fmemopen(void *buf, size_t size, const char *mode)
+{
+	SO_FILE *file;
+	int mode_flags, options;
+
+	if (so_parse_mode(mode, &mode_flags, &options) == -1 || options != 0 ||
+	    size == 0 || size > INT_MAX)
+		return NULL;
+
+	file = so_mem_alloc(mode_flags);
+	if (file == NULL)
+		return NULL;
+
+	/* without a buffer from the caller we work on our own memory */
+	if (buf == NULL) {
+		buf = calloc(1, size);
+		if (buf == NULL) {
+			so_free_file(file);
+			return NULL;
+		}
+		file->mem_owned = 1;
+	}
+
+	file->buffer = buf;
+	file->buffer_size = size;
+
+	/*
+	 * "r" streams see the whole memory, "w" streams start empty and
+	 * "a" streams start at the first null byte
+	 */
+	if (mode[0] == 'r') {
+		file->curr_buff_size = size;
+	} else if (mode[0] == 'w') {
+		file->buffer[0] = '\0';
+	} else {
+		file->curr_buff_size = strnlen(buf, size);
+		file->buffer_position = file->curr_buff_size;
+		file->cursor = file->curr_buff_size;
+	}
+
+	return file;
+}
+
+SO_FILE *so_open_memstream(char **ptr, size_t *sizeloc)
+{
+	SO_FILE *file;
+
+	if (ptr == NULL || sizeloc == NULL)
+		return NULL;
+
+	file = so_mem_alloc(O_RDWR);
+	if (file == NULL)
+		return NULL;
+
+	file->buffer_size = BUF_SIZE;
+	file->buffer = malloc(file->buffer_size + 1);
+	if (file->buffer == NULL) {
+		so_free_file(file);
+		return NULL;
+	}
+
+	file->memstream_ptr = ptr;
+	file->memstream_size = sizeloc;
+	so_memstream_publish(file);
+
+	return file;
+}
+
+SO_FILE *so_fopencookie(void *cookie, const char *mode,
+			so_cookie_io_functions_t io_funcs)
+{
+	SO_FILE *file;
+	int mode_flags, options;
+
+	/* the modifiers are about descriptors, the callbacks do the I/O */
+	if (so_parse_mode(mode, &mode_flags, &options) == -1 || options != 0)
+		return NULL;
+
+	file = so_alloc_file(-1, mode_flags, 0);
+	if (file == NULL)
+		return NULL;
+
+	file->cookie_io = 1;
+	file->cookie = cookie;
+	file->io = io_funcs;
+
+	return file;
+}
+
+int so_fchecksum(SO_FILE *stream, int on)
+{
+	/* the threads of a shared writer have no common order of bytes */
+	if (stream->shared != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	stream->crc_on = on != 0;
+	stream->crc = 0;
+
+	return 0;
+}
+
+unsigned int so_fcrc32c(SO_FILE *stream)
+{
+	return stream->crc;
+}
+
+int so_fsizehint(SO_FILE *stream, long size)
+{
+	struct stat st;
+
+	if (stream->cookie_io || stream->mem || stream->shared != NULL ||
+	    (stream->mode & O_ACCMODE) == O_RDONLY || size < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* size is the one of the file, appenders need to know where it ends */
+	if (stream->mode & O_APPEND) {
+		if (fstat(stream->fd, &st) == -1)
+			return -1;
+		stream->prealloc_base = st.st_size - stream->file_offset;
+	}
+
+	if (size > stream->prealloc_end &&
+	    fallocate(stream->fd, FALLOC_FL_KEEP_SIZE, 0, size) == -1)
+		return -1;
+
+	stream->prealloc = 1;
+	stream->prealloc_hint = size;
+	if (size > stream->prealloc_end)
+		stream->prealloc_end = size;
+
+	return 0;
+}
+
+static int so_sync_fd(SO_FILE *stream, int full)
+{
+	int res;
+
+	/* memory streams have nothing to make durable */
+	if (stream->mem)
+		return 0;
+
+	res = full ? fsync(stream->fd) : fdatasync(stream->fd);
+	if (res == -1)
+		stream->error = 1;
+
+	return res;
+}
+
+/*
+ * group commit: every caller takes a ticket once its data reached the
+ * kernel; one of them waits up to sync_delay microseconds for others to
+ * join and syncs for all the tickets taken so far, while the callers
+ * that come during the sync queue for the next round. a failed sync
+ * fails all the later ones, as the data it lost cannot be synced again
+ */
+static int so_group_sync(SO_FILE *stream, int full)
+{
+	struct timespec deadline;
+	unsigned long ticket, target;
+	int res;
+
+	if (stream->shared != NULL && so_fflush(stream) == SO_EOF)
+		return SO_EOF;
+
+	pthread_mutex_lock(&stream->sync_lock);
+
+	/* the other streams have one buffer, flushed by a caller at a time */
+	if (stream->shared == NULL && so_fflush(stream) == SO_EOF) {
+		pthread_mutex_unlock(&stream->sync_lock);
+		return SO_EOF;
+	}
+
+	ticket = ++stream->sync_requested;
+	if (full)
+		stream->sync_full = 1;
+
+	while (stream->sync_done < ticket && !stream->sync_failed) {
+		if (stream->syncing) {
+			pthread_cond_wait(&stream->sync_cond,
+					  &stream->sync_lock);
+			continue;
+		}
+
+		stream->syncing = 1;
+		if (stream->sync_delay > 0) {
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += stream->sync_delay / 1000000;
+			deadline.tv_nsec += stream->sync_delay % 1000000 * 1000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			while (pthread_cond_timedwait(&stream->sync_cond,
+						      &stream->sync_lock,
+						      &deadline) != ETIMEDOUT)
+				;
+		}
+
+		target = stream->sync_requested;
+		full = stream->sync_full;
+		stream->sync_full = 0;
+		pthread_mutex_unlock(&stream->sync_lock);
+
+		res = so_sync_fd(stream, full);
+
+		pthread_mutex_lock(&stream->sync_lock);
+		if (res == -1)
+			stream->sync_failed = 1;
+		stream->sync_done = target;
+		stream->syncing = 0;
+		pthread_cond_broadcast(&stream->sync_cond);
+	}
+
+	res = stream->sync_failed ? SO_EOF : 0;
+	pthread_mutex_unlock(&stream->sync_lock);
+
+	return res;
+}
+
+int so_fsync(SO_FILE *stream)
 {
-	int pid, arguments_size = 3;
-	SO_FILE *stream = malloc(sizeof(SO_FILE));
-	char **arguments, *p;
-	char separators[2] = " ";
-	int res, file_desc[2], status;
-	int res_exec;
+	if (stream->group_commit)
+		return so_group_sync(stream, 1);
+
+	if (so_fflush(stream) == SO_EOF || so_sync_fd(stream, 1) == -1)
+		return SO_EOF;
+
+	return 0;
+}
+
+int so_fdatasync(SO_FILE *stream)
+{
+	if (stream->group_commit)
+		return so_group_sync(stream, 0);
+
+	if (so_fflush(stream) == SO_EOF || so_sync_fd(stream, 0) == -1)
+		return SO_EOF;
+
+	return 0;
+}
+
+int so_fgroupcommit(SO_FILE *stream, long max_delay_us)
+{
+	stream->group_commit = max_delay_us >= 0;
+	stream->sync_delay = max_delay_us;
+
+	return 0;
+}
 
-	/* initialize buffer fields */
+/*
+ * drop the buffer of a flushed stream whose file changed behind it and
+ * move it to offset; the empty window starts at the cursor of the
+ * descriptor, so so_fseek cannot take it for the data at offset
+ */
+static int so_reposition(SO_FILE *stream, long offset)
+{
 	stream->buffer_position = 0;
-	stream->cursor = 0;
 	stream->curr_buff_size = 0;
+	stream->cursor = stream->file_offset;
 	stream->read_write = -1;
-	stream->error = 0;
-	stream->child_at_end = 0;
 
-	/* create pipe */
-	res = pipe(file_desc);
+	return so_fseek(stream, offset, SEEK_SET);
+}
 
-	if (res == -1)
+/* copy through a buffer, for the file systems without copy_file_range */
+static long so_copy_buffered(SO_FILE *dst, SO_FILE *src, long off_in,
+			     long off_out, size_t len)
+{
+	char *buf = malloc(COPY_BUF_SIZE);
+	size_t done = 0, count;
+	ssize_t res, written, part;
+
+	if (buf == NULL)
+		return -1;
+
+	while (done < len) {
+		count = len - done < COPY_BUF_SIZE ? len - done : COPY_BUF_SIZE;
+		res = so_sys_pread(src, buf, count, off_in + done);
+		if (res <= 0) {
+			if (res == -1)
+				src->error = 1;
+			break;
+		}
+		if (src->crc_on)
+			src->crc = so_crc32c(src->crc, buf, res);
+		if (dst->crc_on)
+			dst->crc = so_crc32c(dst->crc, buf, res);
+
+		for (written = 0; written < res; written += part) {
+			part = so_sys_pwrite(dst, buf + written, res - written,
+					     off_out + done + written);
+			if (part <= 0) {
+				dst->error = 1;
+				free(buf);
+				return done + written;
+			}
+		}
+
+		done += res;
+	}
+
+	free(buf);
+
+	return done;
+}
+
+/*
+ * copy len bytes of a data extent at the given offsets; copy_file_range
+ * lets the file system share the extents (reflink) or copy on the server;
+ * it does not take O_APPEND descriptors and the checksums need the data,
+ * so those go through the buffer, as the copies the file systems refuse
+ */
+static long so_copy_range(SO_FILE *dst, SO_FILE *src, long in, long out,
+			  size_t len, int *fallback)
+{
+	loff_t off_in = in, off_out = out;
+	size_t done = 0;
+	ssize_t res;
+
+	while (!*fallback && done < len) {
+		res = copy_file_range(src->fd, &off_in, dst->fd, &off_out,
+				      len - done < COPY_CHUNK ?
+				      len - done : COPY_CHUNK, 0);
+		if (res == 0)
+			return done;
+		if (res == -1) {
+			if (errno != EXDEV && errno != EINVAL &&
+			    errno != EOPNOTSUPP && errno != ENOSYS &&
+			    errno != EBADF) {
+				src->error = 1;
+				dst->error = 1;
+				return done;
+			}
+			*fallback = 1;
+			break;
+		}
+		done += res;
+	}
+
+	if (done < len) {
+		res = so_copy_buffered(dst, src, in + done, out + done,
+				       len - done);
+		if (res > 0)
+			done += res;
+	}
+
+	return done;
+}
+
+size_t so_fcopy_file(SO_FILE *dst, SO_FILE *src, size_t len)
+{
+	struct stat st_src, st_dst;
+	size_t done = 0;
+	long start_in, start_out, extent, res;
+	int fallback, hole;
+
+	/* both streams have to be buffered views of regular files */
+	if (src->cookie_io || src->mem || src->shared != NULL ||
+	    src->limit >= 0 || dst->cookie_io || dst->mem ||
+	    dst->shared != NULL ||
+	    (src->mode & O_ACCMODE) == O_WRONLY ||
+	    (dst->mode & O_ACCMODE) == O_RDONLY ||
+	    fstat(src->fd, &st_src) == -1 || fstat(dst->fd, &st_dst) == -1 ||
+	    !S_ISREG(st_src.st_mode) || !S_ISREG(st_dst.st_mode)) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	/* the data buffered by both streams goes to the files first */
+	if (so_fflush(src) == SO_EOF || so_fflush(dst) == SO_EOF)
+		return 0;
+
+	start_in = src->cursor;
+	start_out = dst->cursor;
+	fallback = (dst->mode & O_APPEND) || src->crc_on || dst->crc_on;
+	so_sparse_forget(dst);
+	so_pcache_invalidate(dst, start_out, len);
+
+	/*
+	 * the holes of src are not copied: past the end of dst they are left
+	 * as holes, before it they are punched (when the file system can)
+	 */
+	while (done < len) {
+		extent = so_sparse_extent(src, start_in + done, &hole);
+		if (extent == 0)
+			break;
+		if (extent < 0) {
+			extent = len - done;
+			hole = 0;
+		}
+		if ((size_t)extent > len - done)
+			extent = len - done;
+
+		if (hole && !fallback &&
+		    (start_out + (long)done >= st_dst.st_size ||
+		     fallocate(dst->fd,
+			       FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			       start_out + done, extent) == 0)) {
+			done += extent;
+			continue;
+		}
+
+		res = so_copy_range(dst, src, start_in + done,
+				    start_out + done, extent, &fallback);
+		done += res;
+		if (res < extent)
+			break;
+	}
+
+	/* a hole at the end of the data copied still makes the file longer */
+	if (fstat(dst->fd, &st_dst) == 0 &&
+	    start_out + (long)done > st_dst.st_size &&
+	    ftruncate(dst->fd, start_out + done) == -1)
+		dst->error = 1;
+
+	/* both streams continue after the data copied */
+	so_reposition(src, start_in + done);
+	so_reposition(dst, start_out + done);
+
+	if (done < len && !src->error && !dst->error)
+		src->eof = 1;
+
+	return done;
+}
+
+/* read the rest of a file whose size is not known (e.g. under /proc) */
+static char *so_slurp_unknown(int fd, size_t *len)
+{
+	size_t size = 0, cap = BUF_SIZE;
+	char *data = malloc(cap + 1), *bigger;
+	ssize_t res;
+
+	while (data != NULL) {
+		res = read(fd, data + size, cap - size);
+		if (res <= 0) {
+			if (res == 0)
+				break;
+			free(data);
+			return NULL;
+		}
+
+		size += res;
+		if (size == cap) {
+			cap *= 2;
+			bigger = realloc(data, cap + 1);
+			if (bigger == NULL)
+				free(data);
+			data = bigger;
+		}
+	}
+
+	if (data == NULL)
 		return NULL;
+	data[size] = '\0';
+	*len = size;
 
-	/* set file desciptor based on the type given */
-	if (strcmp(type, "r") == 0)
-		stream->fd = file_desc[0];
-	else if (strcmp(type, "w") == 0)
-		stream->fd = file_desc[1];
-	else
+	/* so_fslurp_free takes the large ones for mappings */
+	if (size >= SLURP_MMAP_MIN) {
+		bigger = mmap(NULL, size + 1, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (bigger != MAP_FAILED)
+			memcpy(bigger, data, size + 1);
+		free(data);
+		data = bigger == MAP_FAILED ? NULL : bigger;
+	}
+
+	return data;
+}
+
+/*
+ * map a file followed by a 0 byte: the rest of its last page is zero
+ * filled, and when the file ends at a page boundary the byte comes from
+ * the anonymous page reserved after it
+ */
+static char *so_slurp_map(int fd, size_t size)
+{
+	char *data;
+
+	data = mmap(NULL, size + 1, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED)
 		return NULL;
 
-	/* initialize arguments */
-	arguments = malloc(4 * sizeof(char *));
-	arguments[0] = malloc(3 * sizeof(char));
-	strcpy(arguments[0], "sh");
-	arguments[0][2] = '\0';
-	arguments[1] = malloc(3 * sizeof(char));
-	strcpy(arguments[1], "-c");
-	arguments[1][2] = '\0';
-	arguments[2] = malloc((strlen(command) + 1) * sizeof(char));
-	strcpy(arguments[2], command);
-	arguments[2][strlen(command)] = '\0';
-	arguments[3] = NULL;
+	if (mmap(data, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_FIXED | MAP_POPULATE, fd, 0) == MAP_FAILED) {
+		munmap(data, size + 1);
+		return NULL;
+	}
 
-	/* create child process */
-	pid = fork();
+	return data;
+}
 
-	/* if we had an error then we should treat it */
-	if (pid < 0) {
-		close(file_desc[0]);
-		close(file_desc[1]);
-		for (int i = 0; i < arguments_size; i++) {
-			if (arguments[i])
-				free(arguments[i]);
-		}
-		free(arguments);
-		free(stream);
+char *so_fslurp(const char *pathname, size_t *len)
+{
+	char *data = NULL;
+	struct stat st;
+	size_t size = 0;
+	ssize_t res;
+	int fd;
+
+	fd = open(pathname, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+
+	if (fstat(fd, &st) == -1) {
+		close(fd);
 		return NULL;
 	}
 
-	/* if pid is 0 then we are in the child */
-	if (pid == 0) {
-		/*
-		 * based on the type, close the not necessary channels
-		 * and create a link to either stdin or stdout
-		 */
-		if (strcmp(type, "r") == 0) {
-			close(file_desc[0]);
-			dup2(file_desc[1], STDOUT_FILENO);
-		} else if (strcmp(type, "w") == 0) {
-			close(file_desc[1]);
-			dup2(file_desc[0], STDIN_FILENO);
-		}
+	if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+		data = so_slurp_unknown(fd, len);
+		close(fd);
+		return data;
+	}
 
-		/* execute the command */
-		res_exec = execv("/bin/sh", arguments);
-		if (res_exec)
+	if (st.st_size >= SLURP_MMAP_MIN) {
+		data = so_slurp_map(fd, st.st_size);
+		close(fd);
+		if (data != NULL)
+			*len = st.st_size;
+		return data;
+	}
+
+	/* one allocation and, unless the read is cut short, one read */
+	data = malloc(st.st_size + 1);
+	if (data == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	while (size < (size_t)st.st_size) {
+		res = read(fd, data + size, st.st_size - size);
+		if (res == -1) {
+			free(data);
+			close(fd);
 			return NULL;
-	} else {
-		/* in the parent set the pid */
-		stream->pid = pid;
-		/* close the not necessary channels */
-		if (strcmp(type, "r") == 0)
-			close(file_desc[1]);
-		else if (strcmp(type, "w") == 0)
-			close(file_desc[0]);
+		}
+		/* the file was truncated meanwhile */
+		if (res == 0)
+			break;
+		size += res;
 	}
+	close(fd);
 
-	/* free allocated memory */
-	for (int i = 0; i < arguments_size; i++) {
-		if (arguments[i])
-			free(arguments[i]);
+	data[size] = '\0';
+	*len = size;
+
+	return data;
+}
+
+void so_fslurp_free(char *data, size_t len)
+{
+	if (len >= SLURP_MMAP_MIN)
+		munmap(data, len + 1);
+	else
+		free(data);
+}
+
+int so_ffollowfd(SO_FILE *stream)
+{
+	if (!stream->follow) {
+		errno = EINVAL;
+		return -1;
 	}
-	free(arguments);
 
-	return stream;
+	return stream->follow_fd;
 }
 
-int so_pclose(SO_FILE *stream)
+/* the directory of a so_fopen_many path, opened once per call */
+struct so_dircache {
+	const char *dir;
+	int len;
+	int fd;
+};
+
+/*
+ * the descriptor of the directory of path (AT_FDCWD when it has none),
+ * with the name inside it in *name
+ */
+static int so_dircache_get(struct so_dircache *cache, int *next,
+			   const char *path, const char **name)
 {
-	int res = -1, status;
+	const char *slash = strrchr(path, '/');
+	char *dir;
+	int i, len, fd;
 
-	/*
-	 * if there was a write operation, then we should flush
-	 * the buffer, free the memory and close the file
-	 */
-	if (stream->buffer_position > 0 && stream->read_write == 1) {
-		so_fflush(stream);
-		close(stream->fd);
-		free(stream);
-		return 0;
+	if (slash == NULL) {
+		*name = path;
+		return AT_FDCWD;
 	}
 
-	/* wait for the process */
-	if (stream->pid != -1)
-		res = waitpid(stream->pid, &status, 0);
+	*name = slash + 1;
+	len = slash - path;
+	for (i = 0; i < DIRCACHE_SIZE; i++) {
+		if (cache[i].dir != NULL && cache[i].len == len &&
+		    memcmp(cache[i].dir, path, len) == 0)
+			return cache[i].fd;
+	}
 
-	/* close the file and free the memory */
-	close(stream->fd);
-	free(stream);
+	dir = len == 0 ? strdup("/") : strndup(path, len);
+	if (dir == NULL)
+		return -1;
+	fd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	free(dir);
+	if (fd == -1)
+		return -1;
 
-	if (res >= 0)
+	/* the entries are replaced in turn */
+	i = *next;
+	*next = (*next + 1) % DIRCACHE_SIZE;
+	if (cache[i].dir != NULL)
+		close(cache[i].fd);
+	cache[i].dir = path;
+	cache[i].len = len;
+	cache[i].fd = fd;
+
+	return fd;
+}
+
+int so_fopen_many(const char *const *pathnames, int count, const char *mode,
+		  SO_FILE **files)
+{
+	struct so_dircache cache[DIRCACHE_SIZE];
+	struct so_slab *slab;
+	size_t head, size, page, names = 0;
+	const char *name;
+	char *buffers, *paths;
+	SO_FILE *file;
+	int mode_flags, options, i, dirfd, fd, next = 0, opened = 0;
+
+	if (count <= 0 || so_parse_mode(mode, &mode_flags, &options) == -1 ||
+	    (options & ~SO_OPT_NONBLOCK)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (options & SO_OPT_NONBLOCK)
+		mode_flags |= O_NONBLOCK;
+
+	/* the streams, their buffers and their paths, in one allocation */
+	for (i = 0; i < count; i++)
+		names += strlen(pathnames[i]) + 1;
+	page = sysconf(_SC_PAGESIZE);
+	head = (sizeof(struct so_slab) + 63) / 64 * 64;
+	size = (head + sizeof(SO_FILE) * count + page - 1) / page * page -
+	       head;
+	size += head + (size_t)BUF_SIZE * count + names;
+	if (posix_memalign((void **)&slab, page, size))
+		return -1;
+	memset(slab, 0, size);
+	size = (head + sizeof(SO_FILE) * count + page - 1) / page * page -
+	       head;
+	buffers = (char *)slab + head + size;
+	paths = buffers + (size_t)BUF_SIZE * count;
+
+	memset(cache, 0, sizeof(cache));
+	for (i = 0; i < count; i++) {
+		files[i] = NULL;
+
+		dirfd = so_dircache_get(cache, &next, pathnames[i], &name);
+		if (dirfd == -1)
+			continue;
+		fd = so_openat(dirfd, name, mode_flags);
+		if (fd == -1)
+			continue;
+
+		file = (SO_FILE *)((char *)slab + head) + i;
+		so_init_file(file, fd, mode_flags, options);
+		file->buffer = buffers + (size_t)BUF_SIZE * i;
+		file->buffer_kind = BUFFER_SLAB;
+		file->buffer_align = page;
+		file->pathname = strcpy(paths, pathnames[i]);
+		file->slab = slab;
+		if ((mode_flags & O_ACCMODE) == O_RDWR &&
+		    !(mode_flags & O_APPEND) && options == 0)
+			file->unified = 1;
+
+		paths += strlen(paths) + 1;
+		files[i] = file;
+		opened++;
+	}
+
+	for (i = 0; i < DIRCACHE_SIZE; i++) {
+		if (cache[i].dir != NULL)
+			close(cache[i].fd);
+	}
+
+	slab->refs = opened;
+	if (opened == 0)
+		free(slab);
+
+	return opened;
+}
+
+int so_setvbuf(SO_FILE *stream, size_t size, int flags)
+{
+	struct so_file_buffer {
+		char *data;
+		int kind;
+		size_t align;
+		size_t mapped;
+		int huge;
+	} old = { stream->buffer, stream->buffer_kind, stream->buffer_align,
+		  stream->buffer_mapped, stream->buffer_huge };
+	char *buffer;
+
+	/* only before the first I/O, on streams that own a single buffer */
+	if (stream->read_write != -1 || stream->buffer_position != 0 ||
+	    stream->curr_buff_size != 0 || stream->mem ||
+	    stream->shared != NULL || stream->z != NULL || size == 0 ||
+	    size > INT_MAX ||
+	    size % stream->align != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	buffer = so_buffer_alloc(stream, size, stream->align,
+				 flags & SO_BUF_HUGE);
+	if (buffer == NULL) {
+		stream->buffer_kind = old.kind;
+		stream->buffer_align = old.align;
+		stream->buffer_mapped = old.mapped;
+		stream->buffer_huge = old.huge;
+		return -1;
+	}
+
+	/* release the old buffer with the way it was allocated */
+	if (old.kind == BUFFER_MAPPED)
+		munmap(old.data, old.mapped);
+	else if (old.kind == BUFFER_HEAP)
+		free(old.data);
+
+	stream->buffer = buffer;
+	stream->buffer_size = size;
+
+	return 0;
+}
+
+/* the bytes of the mapping at addr backed by huge pages right now */
+static size_t so_huge_bytes(const char *addr)
+{
+	unsigned long start, end, at = (unsigned long)addr;
+	size_t len, res = 0;
+	char *smaps = so_fslurp("/proc/self/smaps", &len), *line, *next;
+
+	if (smaps == NULL)
 		return 0;
 
-	return -1;
+	/* find the "start-end ..." header of the mapping, then its fields */
+	for (line = smaps; *line != '\0'; line = next) {
+		next = strchr(line, '\n');
+		next = next == NULL ? line + strlen(line) : next + 1;
+
+		start = strtoul(line, &line, 16);
+		if (*line != '-')
+			continue;
+		end = strtoul(line + 1, &line, 16);
+		if (*line != ' ' || at < start || at >= end)
+			continue;
+
+		while ((line = next) != NULL && *line != '\0') {
+			next = strchr(line, '\n');
+			next = next == NULL ? line + strlen(line) : next + 1;
+			if (strncmp(line, "AnonHugePages:", 14) == 0) {
+				res = strtoul(line + 14, NULL, 10) * 1024;
+				break;
+			}
+		}
+		break;
+	}
+
+	so_fslurp_free(smaps, len);
+	return res;
+}
+
+int so_fbufinfo(SO_FILE *stream, struct so_bufinfo *info)
+{
+	info->size = stream->buffer_size;
+	info->align = stream->buffer_align;
+	info->huge_advised = stream->buffer_huge;
+	info->huge_bytes = stream->buffer_huge ?
+			   so_huge_bytes(stream->buffer) : 0;
+
+	return 0;
 }
@@ -23,6 +23,9 @@
 #endif
 
 #include <stdlib.h>
+#if defined(__linux__)
+#include <sys/types.h>
+#endif
 
 #define SEEK_SET	0	/* Seek from beginning of file.  */
 #define SEEK_CUR	1	/* Seek from current position.  */
@@ -34,9 +37,108 @@ struct _so_file;
 
 typedef struct _so_file SO_FILE;
 
+/*
+ * mode is one of "r", "r+", "w", "w+", "a", "a+", optionally followed by:
+ *   'd' - O_DIRECT, the data bypasses the page cache
+ *   's' - shared writer ("w" and "a" only): every thread writes to its own
+ *         buffer, flushed with pwrite at a range of the file reserved with
+ *         a fetch-and-add, so the data of one so_fwrite call is contiguous
+ *         and writers never wait for each other; so_fflush flushes the
+ *         buffer of the calling thread and so_fclose the buffers of all
+ *         the threads, waiting for the writes in flight; there is no
+ *         so_fseek and so_ftell reports the end of the reserved data
+ *   'n' - non-blocking: when the descriptor is not ready, so_fread and
+ *         so_fwrite return a short count (whole members only) and so_fflush
+ *         keeps the data it could not write, without setting so_ferror
+ *   'z' - compressed ("r", "w" and "a" only): the data is stored as blocks
+ *         of up to 64KiB compressed with a built-in LZ77 codec, each with a
+ *         small header, so appending adds blocks and so_fseek on a "r"
+ *         stream jumps to the block holding the offset; so_fflush writes
+ *         the block gathered so far and "w"/"a" streams cannot seek
+ *   't' - with 'z' when writing: the blocks are compressed and written by
+ *         a worker thread, while the next one is being filled
+ *   'h' - hole-aware ("r" only): the data and hole ranges of the file are
+ *         found with SEEK_DATA/SEEK_HOLE and the holes are read as zeros
+ *         without any syscall
+ *   'f' - follow ("r" only, maybe with 'n'): like tail -F, reads at the end
+ *         of the file wait (or fail with EAGAIN with 'n') until inotify
+ *         reports that it grew, was truncated (reading starts over) or
+ *         was replaced at its path (the new file is opened, once the old
+ *         one was read to its end); so_ftell is the offset in the file
+ *         being read
+ */
 FUNC_DECL_PREFIX SO_FILE *so_fopen(const char *pathname, const char *mode);
 FUNC_DECL_PREFIX int so_fclose(SO_FILE *stream);
 
+#if defined(__linux__)
+/* so_fopen for a path relative to the directory open at dirfd */
+FUNC_DECL_PREFIX SO_FILE *so_fopenat(int dirfd, const char *pathname,
+				     const char *mode);
+
+/*
+ * open count paths with the same mode (a base mode, maybe with 'n'),
+ * opening each directory once and the files relative to it; the streams
+ * come from a single allocation and are closed with so_fclose one by
+ * one; returns the number of streams opened (files[i] is NULL for the
+ * paths that failed) or -1 on errors that fail them all
+ */
+FUNC_DECL_PREFIX int so_fopen_many(const char *const *pathnames, int count,
+				   const char *mode, SO_FILE **files);
+
+/* stream over an open descriptor (e.g. a socket or a pipe), see so_fopen */
+FUNC_DECL_PREFIX SO_FILE *so_fdopen(int fd, const char *mode);
+
+/*
+ * memory streams, working without any syscall: so_fmemopen over the size
+ * bytes at buf (allocated by the library when buf is NULL) with one of
+ * the base modes of so_fopen, and so_open_memstream over a growing buffer
+ * published in *ptr and *sizeloc by so_fflush and so_fclose, and owned by
+ * the caller after so_fclose
+ */
+FUNC_DECL_PREFIX SO_FILE *so_fmemopen(void *buf, size_t size, const char *mode);
+FUNC_DECL_PREFIX SO_FILE *so_open_memstream(char **ptr, size_t *sizeloc);
+
+/*
+ * the backend of a so_fopencookie stream: read and write return the
+ * number of bytes transferred (0 from read at the end of the data) or -1
+ * on error; seek moves to *offset relative to whence and stores the new
+ * position in *offset, returning 0 or -1; close returns 0 or -1; a NULL
+ * callback makes the operation fail (or do nothing for close)
+ */
+typedef struct {
+	ssize_t (*read)(void *cookie, char *buf, size_t size);
+	ssize_t (*write)(void *cookie, const char *buf, size_t size);
+	int (*seek)(void *cookie, long *offset, int whence);
+	int (*close)(void *cookie);
+} so_cookie_io_functions_t;
+
+/*
+ * stream over user supplied I/O callbacks, with the same buffering as
+ * the streams over files; mode is one of the base modes of so_fopen
+ */
+FUNC_DECL_PREFIX SO_FILE *so_fopencookie(void *cookie, const char *mode,
+					 so_cookie_io_functions_t io_funcs);
+
+/* events returned by so_fpoll, equal to EPOLLIN and EPOLLOUT */
+#define SO_POLLIN	0x001
+#define SO_POLLOUT	0x004
+
+/*
+ * the events an event loop has to wait for on so_fileno(stream) before
+ * the stream can make progress: SO_POLLIN when the buffered input was
+ * consumed, SO_POLLOUT while output waits in the buffer; 0 means input
+ * is still buffered and can be read without waiting (an edge triggered
+ * epoll would not report it again)
+ */
+FUNC_DECL_PREFIX int so_fpoll(SO_FILE *stream);
+
+/*
+ * the descriptor an event loop waits on (for reading) before it reads
+ * again from a non-blocking follow stream that got to the end of its file
+ */
+FUNC_DECL_PREFIX int so_ffollowfd(SO_FILE *stream);
+#endif
+
 #if defined(__linux__)
 FUNC_DECL_PREFIX int so_fileno(SO_FILE *stream);
 #elif defined(_WIN32)
@@ -60,9 +162,167 @@ size_t so_fwrite(const void *ptr, size_t size, size_t nmemb, SO_FILE *stream);
 FUNC_DECL_PREFIX int so_fgetc(SO_FILE *stream);
 FUNC_DECL_PREFIX int so_fputc(int c, SO_FILE *stream);
 
+#if defined(__linux__)
+/*
+ * push c back to be read next (not for streams with a running checksum);
+ * there is room for as many bytes as the buffer has free, at least one
+ * after a read, while memory streams and "r+"/"w+" streams without any
+ * option letter can only step back over the bytes they read ("a+" works
+ * as the other streams); so_fseek drops the bytes pushed back
+ */
+FUNC_DECL_PREFIX int so_ungetc(int c, SO_FILE *stream);
+
+/*
+ * the next n bytes of stream, inside its buffer, without consuming them
+ * (reading more after the bytes buffered when needed); NULL when fewer
+ * bytes are left before the end of the file (so_feof), on errors or when
+ * n is larger than the buffer (EINVAL); when avail is not NULL it gets
+ * the number of bytes buffered, which can be peeked at again without any
+ * syscall. the pointer is valid until the next operation on the stream
+ */
+FUNC_DECL_PREFIX char *so_fpeek(SO_FILE *stream, size_t n, size_t *avail);
+
+/*
+ * the bytes stream can give (writing 0) or take (writing 1) in its buffer
+ * without any syscall, as so_fpeek and so_freserverecs would: 0 when it
+ * has to be flushed, moved or filled first
+ */
+FUNC_DECL_PREFIX size_t so_fbuffered(SO_FILE *stream, int writing);
+
+/*
+ * fixed-size records read and written in place, in batches: so_freadrecs
+ * consumes up to max whole records of size bytes and returns them in
+ * *count (0 with NULL at the end of the file, on errors or when a record
+ * does not fit in the buffer), completing a record split by the end of
+ * the buffer first; so_freserverecs returns room for up to max records
+ * (*count, at least one) in the buffer, to be filled and then passed on
+ * with so_fcommitrecs, for as many records as were filled. the pointers
+ * are valid until the next operation on the stream, and use so_setvbuf
+ * for larger batches. the pointers are not aligned for the type of the
+ * records in general: they are only while every transfer on the stream is
+ * a multiple of its alignment, otherwise copy the records with memcpy
+ */
+FUNC_DECL_PREFIX void *so_freadrecs(SO_FILE *stream, size_t size, size_t max,
+				    size_t *count);
+FUNC_DECL_PREFIX void *so_freserverecs(SO_FILE *stream, size_t size,
+				       size_t max, size_t *count);
+FUNC_DECL_PREFIX int so_fcommitrecs(SO_FILE *stream, size_t size,
+				    size_t count);
+#endif
+
 FUNC_DECL_PREFIX int so_feof(SO_FILE *stream);
 FUNC_DECL_PREFIX int so_ferror(SO_FILE *stream);
 
+#if defined(__linux__)
+/*
+ * positional I/O: read/write count bytes at offset without using or moving
+ * the cursor of the stream, so several threads can use the same stream
+ * concurrently; the buffer of the stream is bypassed, so pending
+ * so_fwrite data has to be flushed first; return the number of bytes
+ * transferred, so_ferror reports the failures
+ */
+FUNC_DECL_PREFIX
+size_t so_pread(SO_FILE *stream, void *ptr, size_t count, long offset);
+FUNC_DECL_PREFIX
+size_t so_pwrite(SO_FILE *stream, const void *ptr, size_t count, long offset);
+
+/*
+ * called for every chunk of so_fscan_chunks with a read only stream
+ * limited to the chunk; so_ftell gives offsets in the whole file and the
+ * stream is released by the library, it must not be closed
+ */
+typedef int (*so_chunk_func)(SO_FILE *chunk, int index, void *arg);
+
+/*
+ * split the file in nchunks byte ranges and call func for each of them
+ * from a pool of nthreads threads (<= 0 for one per CPU), each chunk
+ * read through its own buffer with pread; when delim is not SO_EOF the
+ * chunks start right after a delim byte; returns when all the chunks
+ * were processed, 0 or the first non zero value returned by func
+ */
+FUNC_DECL_PREFIX int so_fscan_chunks(SO_FILE *stream, int nchunks, int delim,
+				     so_chunk_func func, void *arg,
+				     int nthreads);
+
+/*
+ * running CRC32C: after so_fchecksum(stream, 1), so_fcrc32c returns the
+ * checksum of all the bytes consumed by so_fread/so_fgetc and accepted by
+ * so_fwrite/so_fputc since then, in stream order (so_fchecksum resets it
+ * and fails on shared writers); so_crc32c(crc, buf, len) extends crc (0
+ * for no data) with len more bytes, using SSE4.2 and PCLMUL when the CPU
+ * has them
+ */
+FUNC_DECL_PREFIX int so_fchecksum(SO_FILE *stream, int on);
+FUNC_DECL_PREFIX unsigned int so_fcrc32c(SO_FILE *stream);
+FUNC_DECL_PREFIX unsigned int so_crc32c(unsigned int crc, const void *buf,
+					size_t len);
+
+/*
+ * the file written by stream is expected to grow to size bytes: the space
+ * is reserved now (without changing the size of the file) and the writes
+ * past it keep reserving extents ahead, as large as the file up to 64MiB;
+ * streams in append mode do the latter on their own after their first
+ * MiB. so_fclose gives back the space left past the end of the file
+ */
+FUNC_DECL_PREFIX int so_fsizehint(SO_FILE *stream, long size);
+
+/*
+ * so_fflush followed by fsync (or fdatasync); with group commit on
+ * (max_delay_us >= 0, -1 turns it off) the calls made at the same time
+ * from several threads share one flush and sync: the first caller waits
+ * up to max_delay_us for the others, then syncs for all of them, while
+ * the ones coming later are batched for the next sync. the callers of a
+ * stream that is not a shared writer have to serialize their writes
+ */
+FUNC_DECL_PREFIX int so_fsync(SO_FILE *stream);
+FUNC_DECL_PREFIX int so_fdatasync(SO_FILE *stream);
+FUNC_DECL_PREFIX int so_fgroupcommit(SO_FILE *stream, long max_delay_us);
+
+/*
+ * copy up to len bytes from the cursor of src to the cursor of dst, both
+ * streams over regular files, without going through their buffers (with
+ * copy_file_range when the file systems can do it, which may share the
+ * extents); the holes of src stay holes in dst, unless dst is in append
+ * mode or has a running checksum; both cursors move past the data, fewer
+ * than len bytes are copied at the end of src (so_feof) or on errors
+ * (so_ferror)
+ */
+FUNC_DECL_PREFIX size_t so_fcopy_file(SO_FILE *dst, SO_FILE *src, size_t len);
+
+/*
+ * the whole content of a file, with its size in *len and followed by a 0
+ * byte, read at once without a stream (large files are mapped); it is
+ * released with so_fslurp_free(data, *len)
+ */
+FUNC_DECL_PREFIX char *so_fslurp(const char *pathname, size_t *len);
+FUNC_DECL_PREFIX void so_fslurp_free(char *data, size_t len);
+
+/* so_setvbuf flag: back the buffer with transparent huge pages */
+#define SO_BUF_HUGE	0x1
+
+/*
+ * replace the buffer of stream (before its first I/O, not for memory,
+ * shared or compressed streams) with one of size bytes (a multiple of the
+ * block size for 'd' streams); the buffers are page aligned and with
+ * SO_BUF_HUGE, from 2MiB up, mapped in whole huge pages advised with
+ * MADV_HUGEPAGE
+ */
+FUNC_DECL_PREFIX int so_setvbuf(SO_FILE *stream, size_t size, int flags);
+
+/* the buffer of a stream, as reported by so_fbufinfo */
+struct so_bufinfo {
+	size_t size;
+	/* the alignment of its address */
+	size_t align;
+	/* 1 if it was advised for huge pages */
+	int huge_advised;
+	/* how much of it the kernel backs with huge pages right now */
+	size_t huge_bytes;
+};
+
+FUNC_DECL_PREFIX int so_fbufinfo(SO_FILE *stream, struct so_bufinfo *info);
+#endif
+
 FUNC_DECL_PREFIX SO_FILE *so_popen(const char *command, const char *type);
 FUNC_DECL_PREFIX int so_pclose(SO_FILE *stream);
 
@@ -0,0 +1,957 @@
+/*
+ * C++ layer over the STDIO library, header only
+ *
+ * so::stream<Policy> owns a SO_FILE (move only, closed by the destructor);
+ * the policy fixes at compile time how the stream is opened and closed,
+ * which directions it has and the size of its buffer, so reading from a
+ * writer (or seeking a pipe) does not compile instead of failing at run
+ * time, and the inline wrappers carry no mode checks of their own
+ */
+
+#ifndef SO_STDIO_HPP
+#define SO_STDIO_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <span>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "so_stdio.h"
+}
+
+namespace so {
+
+/*
+ * the policies: mode is given to so_fopen (or so_popen), BufferSize (a
+ * multiple of the page size, 0 for the default of the library) to
+ * so_setvbuf right after opening, with huge pages from 2MiB up
+ */
+template <std::size_t BufferSize, bool Readable, bool Writable,
+	  bool Seekable>
+struct file_policy {
+	static constexpr std::size_t buffer_size = BufferSize;
+	static constexpr bool readable = Readable;
+	static constexpr bool writable = Writable;
+	static constexpr bool seekable = Seekable;
+
+	static int close(SO_FILE *file) noexcept
+	{
+		return so_fclose(file);
+	}
+};
+
+template <std::size_t BufferSize = 0>
+struct read_only : file_policy<BufferSize, true, false, true> {
+	static SO_FILE *open(const char *path) noexcept
+	{
+		return so_fopen(path, "r");
+	}
+};
+
+template <std::size_t BufferSize = 0>
+struct write_only : file_policy<BufferSize, false, true, true> {
+	static SO_FILE *open(const char *path) noexcept
+	{
+		return so_fopen(path, "w");
+	}
+};
+
+template <std::size_t BufferSize = 0>
+struct append_only : file_policy<BufferSize, false, true, false> {
+	static SO_FILE *open(const char *path) noexcept
+	{
+		return so_fopen(path, "a");
+	}
+};
+
+/* "r+": the file has to exist, it is read and written in place */
+template <std::size_t BufferSize = 0>
+struct read_write : file_policy<BufferSize, true, true, true> {
+	static SO_FILE *open(const char *path) noexcept
+	{
+		return so_fopen(path, "r+");
+	}
+};
+
+/* the output (popen_read) or the input (popen_write) of a command */
+template <bool Read, std::size_t BufferSize>
+struct popen_policy : file_policy<BufferSize, Read, !Read, false> {
+	static SO_FILE *open(const char *command) noexcept
+	{
+		return so_popen(command, Read ? "r" : "w");
+	}
+
+	static int close(SO_FILE *file) noexcept
+	{
+		return so_pclose(file);
+	}
+};
+
+template <std::size_t BufferSize = 0>
+using popen_read = popen_policy<true, BufferSize>;
+
+template <std::size_t BufferSize = 0>
+using popen_write = popen_policy<false, BufferSize>;
+
+/* the elements read and written as raw bytes */
+template <typename T>
+concept trivial = std::is_trivially_copyable_v<T>;
+
+template <typename Policy>
+class stream {
+public:
+	using policy = Policy;
+
+	stream() noexcept = default;
+
+	/* a path for the file policies, a command for the popen ones */
+	explicit stream(const char *name) noexcept
+		: file_(Policy::open(name))
+	{
+		if constexpr (Policy::buffer_size != 0) {
+			if (file_ != nullptr &&
+			    so_setvbuf(file_, Policy::buffer_size,
+				       Policy::buffer_size >= (2u << 20) ?
+				       SO_BUF_HUGE : 0) == -1) {
+				Policy::close(file_);
+				file_ = nullptr;
+			}
+		}
+	}
+
+	stream(const stream &) = delete;
+	stream &operator=(const stream &) = delete;
+
+	stream(stream &&other) noexcept
+		: file_(std::exchange(other.file_, nullptr)),
+		  stage_(std::exchange(other.stage_, nullptr)),
+		  stage_size_(std::exchange(other.stage_size_, 0)),
+		  stage_align_(std::exchange(other.stage_align_, 0)),
+		  staged_(std::exchange(other.staged_, false))
+	{
+	}
+
+	stream &operator=(stream &&other) noexcept
+	{
+		if (this != &other) {
+			close();
+			std::free(stage_);
+			file_ = std::exchange(other.file_, nullptr);
+			stage_ = std::exchange(other.stage_, nullptr);
+			stage_size_ = std::exchange(other.stage_size_, 0);
+			stage_align_ = std::exchange(other.stage_align_, 0);
+			staged_ = std::exchange(other.staged_, false);
+		}
+		return *this;
+	}
+
+	~stream()
+	{
+		close();
+		std::free(stage_);
+	}
+
+	/* the result of so_fclose (so_pclose), SO_EOF when nothing was open */
+	int close() noexcept
+	{
+		return file_ != nullptr ?
+		       Policy::close(std::exchange(file_, nullptr)) : SO_EOF;
+	}
+
+	/* give the SO_FILE up, the caller closes it */
+	SO_FILE *release() noexcept
+	{
+		return std::exchange(file_, nullptr);
+	}
+
+	SO_FILE *native() const noexcept
+	{
+		return file_;
+	}
+
+	explicit operator bool() const noexcept
+	{
+		return file_ != nullptr;
+	}
+
+	bool eof() const noexcept
+	{
+		return so_feof(file_);
+	}
+
+	bool error() const noexcept
+	{
+		return so_ferror(file_);
+	}
+
+	int fileno() const noexcept
+	{
+		return so_fileno(file_);
+	}
+
+	/* the number of whole elements read */
+	template <trivial T, std::size_t N>
+	std::size_t read(std::span<T, N> buf) noexcept
+		requires Policy::readable && (!std::is_const_v<T>)
+	{
+		return so_fread(buf.data(), sizeof(T), buf.size(), file_);
+	}
+
+	int getc() noexcept
+		requires Policy::readable
+	{
+		return so_fgetc(file_);
+	}
+
+	int ungetc(int c) noexcept
+		requires Policy::readable
+	{
+		return so_ungetc(c, file_);
+	}
+
+	/* the next n bytes inside the buffer, empty when there are fewer */
+	std::span<const char> peek(std::size_t n) noexcept
+		requires Policy::readable
+	{
+		const char *data = so_fpeek(file_, n, nullptr);
+
+		return data != nullptr ? std::span<const char>(data, n) :
+		       std::span<const char>();
+	}
+
+	/*
+	 * the next batch of whole records, consumed, inside the buffer; when
+	 * they are not aligned there for T, they are copied with so_fread to
+	 * storage of the stream
+	 */
+	template <trivial T>
+	std::span<const T> read_records(std::size_t max) noexcept
+		requires Policy::readable
+	{
+		std::size_t count;
+		const char *data;
+		void *recs;
+
+		if constexpr (alignof(T) > 1) {
+			data = so_fpeek(file_, sizeof(T), &count);
+			if (data != nullptr && max > 0 && !aligned<T>(data)) {
+				count = std::min(max, count / sizeof(T));
+				recs = stage<T>(count);
+				if (recs == nullptr)
+					return {};
+				count = so_fread(recs, sizeof(T), count, file_);
+				return std::span<const T>(
+					static_cast<const T *>(recs), count);
+			}
+		}
+
+		recs = so_freadrecs(file_, sizeof(T), max, &count);
+		return std::span<const T>(static_cast<const T *>(recs),
+					  count);
+	}
+
+	/* the number of whole elements accepted */
+	template <trivial T, std::size_t N>
+	std::size_t write(std::span<T, N> buf) noexcept
+		requires Policy::writable
+	{
+		return so_fwrite(buf.data(), sizeof(T), buf.size(), file_);
+	}
+
+	int putc(int c) noexcept
+		requires Policy::writable
+	{
+		return so_fputc(c, file_);
+	}
+
+	/*
+	 * room for up to max records inside the buffer, handed over with
+	 * commit_records once filled; when the buffer is not aligned for T
+	 * the room is storage of the stream, which commit_records writes
+	 * with so_fwrite
+	 */
+	template <trivial T>
+	std::span<T> reserve_records(std::size_t max) noexcept
+		requires Policy::writable
+	{
+		std::size_t count;
+		void *recs = so_freserverecs(file_, sizeof(T), max, &count);
+
+		staged_ = false;
+		if (recs != nullptr && !aligned<T>(recs)) {
+			recs = stage<T>(count);
+			staged_ = recs != nullptr;
+			if (!staged_)
+				count = 0;
+		}
+		return std::span<T>(static_cast<T *>(recs), count);
+	}
+
+	template <trivial T>
+	int commit_records(std::size_t count) noexcept
+		requires Policy::writable
+	{
+		if (staged_) {
+			staged_ = false;
+			return so_fwrite(stage_, sizeof(T), count, file_) ==
+			       count ? 0 : SO_EOF;
+		}
+		return so_fcommitrecs(file_, sizeof(T), count);
+	}
+
+	int flush() noexcept
+		requires Policy::writable
+	{
+		return so_fflush(file_);
+	}
+
+	int seek(long offset, int whence = SEEK_SET) noexcept
+		requires Policy::seekable
+	{
+		return so_fseek(file_, offset, whence);
+	}
+
+	long tell() const noexcept
+		requires Policy::seekable
+	{
+		return so_ftell(file_);
+	}
+
+private:
+	template <typename T>
+	static bool aligned(const void *p) noexcept
+	{
+		return reinterpret_cast<std::uintptr_t>(p) % alignof(T) == 0;
+	}
+
+	/* storage for count records of T, kept for the next batches */
+	template <typename T>
+	void *stage(std::size_t count) noexcept
+	{
+		std::size_t align = std::max(alignof(T), sizeof(void *));
+		std::size_t bytes = (count * sizeof(T) + align - 1) / align *
+				    align;
+
+		if (bytes > stage_size_ || align > stage_align_) {
+			std::free(stage_);
+			stage_ = std::aligned_alloc(align, bytes);
+			stage_size_ = stage_ != nullptr ? bytes : 0;
+			stage_align_ = stage_ != nullptr ? align : 0;
+		}
+		return stage_;
+	}
+
+	SO_FILE *file_ = nullptr;
+	/* the records copied when the buffer is not aligned for them */
+	void *stage_ = nullptr;
+	std::size_t stage_size_ = 0;
+	std::size_t stage_align_ = 0;
+	bool staged_ = false;
+};
+
+/*
+ * std::streambuf over a SO_FILE with the buffer of the stream as its get
+ * and put areas: the get area is what so_fpeek has buffered, consumed with
+ * so_freadrecs when it runs out, and the put area the room returned by
+ * so_freserverecs, handed over with so_fcommitrecs, so iostreams work on
+ * a single buffer. the SO_FILE is not owned and must not be used directly
+ * while the streambuf is, other than after pubsync
+ */
+class streambuf : public std::streambuf {
+public:
+	explicit streambuf(SO_FILE *file) noexcept
+		: file_(file)
+	{
+	}
+
+	template <typename Policy>
+	explicit streambuf(stream<Policy> &owner) noexcept
+		: file_(owner.native())
+	{
+	}
+
+	streambuf(const streambuf &) = delete;
+	streambuf &operator=(const streambuf &) = delete;
+
+	~streambuf() override
+	{
+		sync();
+	}
+
+	SO_FILE *native() const noexcept
+	{
+		return file_;
+	}
+
+protected:
+	int_type underflow() override
+	{
+		std::size_t avail;
+		char *data;
+
+		if (sync_areas() == -1)
+			return traits_type::eof();
+
+		data = so_fpeek(file_, 1, &avail);
+		if (data == nullptr)
+			return traits_type::eof();
+
+		setg(data, data, data + avail);
+		return traits_type::to_int_type(*data);
+	}
+
+	/*
+	 * the byte goes back into the SO_FILE with so_ungetc, or the SO_FILE
+	 * moves back over it when it is not given (unget)
+	 */
+	int_type pbackfail(int_type c) override
+	{
+		if (sync_areas() == -1)
+			return traits_type::eof();
+
+		if (traits_type::eq_int_type(c, traits_type::eof()))
+			return so_fseek(file_, -1, SEEK_CUR) == 0 ?
+			       traits_type::not_eof(c) : traits_type::eof();
+
+		if (so_ungetc(traits_type::to_char_type(c) & 0xff,
+			      file_) == SO_EOF)
+			return traits_type::eof();
+
+		return c;
+	}
+
+	std::streamsize showmanyc() override
+	{
+		return egptr() - gptr();
+	}
+
+	/* what the get area does not have comes straight from so_fread */
+	std::streamsize xsgetn(char *s, std::streamsize n) override
+	{
+		std::streamsize done = std::min(n, egptr() - gptr());
+
+		/* an empty get area has null pointers, not valid for memcpy */
+		if (done > 0) {
+			std::memcpy(s, gptr(), done);
+			gbump(done);
+		}
+		if (done == n)
+			return n;
+
+		if (sync_areas() == -1)
+			return done;
+
+		return done + so_fread(s + done, 1, n - done, file_);
+	}
+
+	int_type overflow(int_type c) override
+	{
+		std::size_t room;
+		char *data;
+
+		if (sync_areas() == -1)
+			return traits_type::eof();
+		if (traits_type::eq_int_type(c, traits_type::eof()))
+			return traits_type::not_eof(c);
+
+		data = static_cast<char *>(so_freserverecs(file_, 1,
+							   (std::size_t)-1,
+							   &room));
+		if (data == nullptr)
+			return traits_type::eof();
+
+		setp(data, data + room);
+		*pptr() = traits_type::to_char_type(c);
+		pbump(1);
+		return c;
+	}
+
+	/* the writes larger than the put area go to so_fwrite at once */
+	std::streamsize xsputn(const char *s, std::streamsize n) override
+	{
+		if (n <= epptr() - pptr()) {
+			if (n > 0) {
+				std::memcpy(pptr(), s, n);
+				pbump(n);
+			}
+			return n;
+		}
+
+		if (sync_areas() == -1)
+			return 0;
+
+		return so_fwrite(s, 1, n, file_);
+	}
+
+	int sync() override
+	{
+		if (sync_areas() == -1)
+			return -1;
+
+		return so_fflush(file_) == SO_EOF ? -1 : 0;
+	}
+
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+			 std::ios_base::openmode) override
+	{
+		int whence = dir == std::ios_base::beg ? SEEK_SET :
+			     dir == std::ios_base::cur ? SEEK_CUR : SEEK_END;
+
+		if (sync_areas() == -1)
+			return pos_type(off_type(-1));
+
+		/* the position alone is asked without moving the SO_FILE */
+		if (!(dir == std::ios_base::cur && off == 0) &&
+		    so_fseek(file_, off, whence) == -1)
+			return pos_type(off_type(-1));
+
+		return pos_type(so_ftell(file_));
+	}
+
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which) override
+	{
+		return seekoff(off_type(pos), std::ios_base::beg, which);
+	}
+
+private:
+	/*
+	 * tell the SO_FILE what was consumed from the get area and written
+	 * to the put area, dropping both
+	 */
+	int sync_areas() noexcept
+	{
+		std::size_t count, used = gptr() - eback();
+		int res = 0;
+
+		if (used > 0)
+			so_freadrecs(file_, 1, used, &count);
+		setg(nullptr, nullptr, nullptr);
+
+		used = pptr() - pbase();
+		if (used > 0 && so_fcommitrecs(file_, 1, used) == SO_EOF)
+			res = -1;
+		setp(nullptr, nullptr);
+
+		return res;
+	}
+
+	SO_FILE *file_;
+};
+
+namespace detail {
+
+/*
+ * the single pass iterator of the ranges below: the range keeps the
+ * state, so the loop can stop anywhere and the SO_FILE is left right
+ * after what was iterated over
+ */
+template <typename Range>
+class range_iterator {
+public:
+	using value_type = typename Range::value_type;
+	using difference_type = std::ptrdiff_t;
+
+	range_iterator() noexcept = default;
+
+	explicit range_iterator(Range *range) noexcept
+		: range_(range)
+	{
+	}
+
+	value_type operator*() const noexcept
+	{
+		return range_->current();
+	}
+
+	range_iterator &operator++()
+	{
+		range_->advance();
+		return *this;
+	}
+
+	void operator++(int)
+	{
+		range_->advance();
+	}
+
+	bool operator==(std::default_sentinel_t) const noexcept
+	{
+		return range_->done();
+	}
+
+private:
+	Range *range_ = nullptr;
+};
+
+/*
+ * what so_fpeek has buffered, consumed with so_freadrecs once the range
+ * moves past it (or ends); the element the range is on counts as read, so
+ * a loop left with break goes on right after the last byte, line or chunk
+ * it got
+ */
+class window {
+public:
+	explicit window(SO_FILE *file) noexcept
+		: file_(file)
+	{
+	}
+
+	window(const window &) = delete;
+	window &operator=(const window &) = delete;
+
+	~window()
+	{
+		consume(cur_ - start_);
+	}
+
+protected:
+	/*
+	 * the next n bytes or more at cur_, after consuming what was iterated
+	 * over; otherwise false, with the bytes buffered in avail_ (fewer at
+	 * the end of the file) and errno EINVAL when n does not fit in the
+	 * buffer
+	 */
+	bool fill(std::size_t n) noexcept
+	{
+		char *data;
+
+		consume(cur_ - start_);
+		errno = 0;
+		data = so_fpeek(file_, n, &avail_);
+		if (data == nullptr)
+			return false;
+
+		start_ = cur_ = data;
+		end_ = data + avail_;
+		return true;
+	}
+
+	void consume(std::size_t n) noexcept
+	{
+		std::size_t count;
+
+		if (n > 0)
+			so_freadrecs(file_, 1, n, &count);
+		start_ = cur_ = end_ = nullptr;
+	}
+
+	SO_FILE *file_;
+	const char *start_ = nullptr;
+	const char *cur_ = nullptr;
+	const char *end_ = nullptr;
+	std::size_t avail_ = 0;
+};
+
+} /* namespace detail */
+
+/*
+ * the bytes of a SO_FILE, read straight from its buffer: the library is
+ * only called when the buffer runs out, so range-for loops and standard
+ * algorithms run at the speed of memory
+ */
+class bytes_range : detail::window {
+public:
+	using value_type = char;
+	using iterator = detail::range_iterator<bytes_range>;
+
+	explicit bytes_range(SO_FILE *file) noexcept
+		: window(file)
+	{
+	}
+
+	~bytes_range()
+	{
+		if (cur_ != nullptr)
+			cur_++;
+	}
+
+	iterator begin()
+	{
+		if (cur_ == end_)
+			fill(1);
+		return iterator(this);
+	}
+
+	std::default_sentinel_t end() const noexcept
+	{
+		return {};
+	}
+
+private:
+	friend iterator;
+
+	char current() const noexcept
+	{
+		return *cur_;
+	}
+
+	void advance() noexcept
+	{
+		if (++cur_ == end_)
+			fill(1);
+	}
+
+	bool done() const noexcept
+	{
+		return cur_ == nullptr;
+	}
+};
+
+/*
+ * the lines of a SO_FILE without their '\n', found with memchr in its
+ * buffer: a line is a view into the buffer, or into a string of the range
+ * for the lines longer than the buffer, valid until the next one
+ */
+class lines_range : detail::window {
+public:
+	using value_type = std::string_view;
+	using iterator = detail::range_iterator<lines_range>;
+
+	explicit lines_range(SO_FILE *file) noexcept
+		: window(file)
+	{
+	}
+
+	~lines_range()
+	{
+		if (next_ != nullptr)
+			cur_ = next_;
+	}
+
+	iterator begin()
+	{
+		if (!started_)
+			advance();
+		return iterator(this);
+	}
+
+	std::default_sentinel_t end() const noexcept
+	{
+		return {};
+	}
+
+private:
+	friend iterator;
+
+	std::string_view current() const noexcept
+	{
+		return line_;
+	}
+
+	void advance()
+	{
+		std::size_t scanned = 0;
+		const char *nl;
+
+		started_ = true;
+		long_line_.clear();
+		cur_ = next_;
+
+		/* the next line is often in the window already */
+		if (cur_ != nullptr && cur_ != end_) {
+			nl = static_cast<const char *>(
+				std::memchr(cur_, '\n', end_ - cur_));
+			if (nl != nullptr) {
+				next_ = nl + 1;
+				return found(std::string_view(cur_, nl - cur_));
+			}
+			scanned = end_ - cur_;
+		}
+
+		for (;;) {
+			/* the line goes on past the bytes buffered so far */
+			if (!fill(scanned + 1)) {
+				if (errno == EINVAL && scanned > 0) {
+					spill(scanned);
+					scanned = 0;
+					continue;
+				}
+				break;
+			}
+
+			nl = static_cast<const char *>(
+				std::memchr(cur_ + scanned, '\n',
+					    end_ - cur_ - scanned));
+			if (nl != nullptr) {
+				next_ = nl + 1;
+				return found(std::string_view(cur_, nl - cur_));
+			}
+
+			scanned = end_ - cur_;
+		}
+
+		/* the last line may have no '\n' */
+		next_ = nullptr;
+		if (scanned > 0 && so_feof(file_) && fill(scanned)) {
+			next_ = end_;
+			return found(std::string_view(cur_, end_ - cur_));
+		}
+		if (!long_line_.empty())
+			return found(std::string_view());
+		done_ = true;
+	}
+
+	/* the part of a line too long for the buffer goes to long_line_ */
+	void spill(std::size_t scanned)
+	{
+		fill(scanned);
+		long_line_.append(cur_, scanned);
+		cur_ += scanned;
+	}
+
+	void found(std::string_view line)
+	{
+		if (long_line_.empty()) {
+			line_ = line;
+			return;
+		}
+		long_line_.append(line);
+		line_ = long_line_;
+	}
+
+	bool done() const noexcept
+	{
+		return done_;
+	}
+
+	std::string_view line_;
+	std::string long_line_;
+	const char *next_ = nullptr;
+	bool started_ = false;
+	bool done_ = false;
+};
+
+/*
+ * the data of a SO_FILE in chunks of size bytes (the last one may be
+ * shorter), in its buffer when they fit, otherwise read into a vector
+ */
+class chunks_range : detail::window {
+public:
+	using value_type = std::span<const char>;
+	using iterator = detail::range_iterator<chunks_range>;
+
+	chunks_range(SO_FILE *file, std::size_t size) noexcept
+		: window(file), size_(size)
+	{
+	}
+
+	~chunks_range()
+	{
+		if (chunk_.data() == cur_)
+			cur_ += chunk_.size();
+	}
+
+	iterator begin()
+	{
+		if (!started_)
+			advance();
+		return iterator(this);
+	}
+
+	std::default_sentinel_t end() const noexcept
+	{
+		return {};
+	}
+
+private:
+	friend iterator;
+
+	std::span<const char> current() const noexcept
+	{
+		return chunk_;
+	}
+
+	void advance()
+	{
+		std::size_t count;
+
+		started_ = true;
+		if (chunk_.data() == cur_)
+			cur_ += chunk_.size();
+
+		/* the next chunk is often in the window already */
+		if (cur_ != nullptr &&
+		    static_cast<std::size_t>(end_ - cur_) >= size_) {
+			chunk_ = std::span<const char>(cur_, size_);
+			return;
+		}
+
+		if (fill(size_)) {
+			chunk_ = std::span<const char>(cur_, size_);
+		} else if (errno == EINVAL) {
+			/* larger than the buffer: copied, with so_fread */
+			big_.resize(size_);
+			count = so_fread(big_.data(), 1, size_, file_);
+			chunk_ = std::span<const char>(big_.data(), count);
+		} else if (avail_ > 0 && so_feof(file_) && fill(avail_)) {
+			chunk_ = std::span<const char>(cur_, avail_);
+		} else {
+			chunk_ = std::span<const char>();
+		}
+	}
+
+	bool done() const noexcept
+	{
+		return chunk_.empty();
+	}
+
+	std::size_t size_;
+	std::span<const char> chunk_;
+	std::vector<char> big_;
+	bool started_ = false;
+};
+
+inline bytes_range bytes(SO_FILE *file) noexcept
+{
+	return bytes_range(file);
+}
+
+inline lines_range lines(SO_FILE *file) noexcept
+{
+	return lines_range(file);
+}
+
+inline chunks_range chunks(SO_FILE *file, std::size_t size) noexcept
+{
+	return chunks_range(file, size);
+}
+
+template <typename Policy>
+	requires Policy::readable
+bytes_range bytes(stream<Policy> &file) noexcept
+{
+	return bytes_range(file.native());
+}
+
+template <typename Policy>
+	requires Policy::readable
+lines_range lines(stream<Policy> &file) noexcept
+{
+	return lines_range(file.native());
+}
+
+template <typename Policy>
+	requires Policy::readable
+chunks_range chunks(stream<Policy> &file, std::size_t size) noexcept
+{
+	return chunks_range(file.native(), size);
+}
+
+/* the stream types used most */
+using reader = stream<read_only<>>;
+using writer = stream<write_only<>>;
+
+} /* namespace so */
+
+#endif /* SO_STDIO_HPP */